@@ -2,6 +2,73 @@
  * Copyright (C) 2019 Santiago León O.
  */
 
+// Functions shared by all tree variants, they only depend on the tree being a
+// binary search tree where nodes have key, value, left and right.
+#define BINARY_TREE_COMMON_FUNCTIONS(PREFIX,KEY_TYPE,VALUE_TYPE,CMP_A_TO_B)                              \
+                                                                                                         \
+bool PREFIX ## _tree_lookup (struct PREFIX ## _tree_t *tree,                                             \
+                             KEY_TYPE key,                                                               \
+                             struct PREFIX ## _tree_node_t **result)                                     \
+{                                                                                                        \
+    bool key_found = false;                                                                              \
+    struct PREFIX ## _tree_node_t **curr_node = &tree->root;                                             \
+    while (*curr_node != NULL) {                                                                         \
+        KEY_TYPE a = key;                                                                                \
+        KEY_TYPE b = (*curr_node)->key;                                                                  \
+        int c = CMP_A_TO_B;                                                                              \
+        if (c < 0) {                                                                                     \
+            curr_node = &(*curr_node)->left;                                                             \
+                                                                                                         \
+        } else if (c > 0) {                                                                              \
+            curr_node = &(*curr_node)->right;                                                            \
+                                                                                                         \
+        } else {                                                                                         \
+            key_found = true;                                                                            \
+            break;                                                                                       \
+        }                                                                                                \
+    }                                                                                                    \
+                                                                                                         \
+    if (result != NULL) {                                                                                \
+        if (key_found) {                                                                                 \
+            *result = *curr_node;                                                                        \
+        } else {                                                                                         \
+            *result = NULL;                                                                              \
+        }                                                                                                \
+    }                                                                                                    \
+                                                                                                         \
+    return key_found;                                                                                    \
+}                                                                                                        \
+                                                                                                         \
+bool PREFIX ## _maybe_get (struct PREFIX ## _tree_t *tree,                                               \
+                           KEY_TYPE key, VALUE_TYPE *value)                                              \
+{                                                                                                        \
+    struct PREFIX ## _tree_node_t *result_node;                                                          \
+    if (PREFIX ## _tree_lookup (tree, key, &result_node)) {                                              \
+        *value = result_node->value;                                                                     \
+        return true;                                                                                     \
+    }                                                                                                    \
+                                                                                                         \
+    return false;                                                                                        \
+}                                                                                                        \
+                                                                                                         \
+/*
+ * This is only a convenience function. A zeroed out value will be returned
+ * if the key is not found. There is no way to differentiate a zeroed out
+ * stored value from a non existing key, use *_tree_lookup() for that.
+ */                                                                                                      \
+VALUE_TYPE PREFIX ## _get (struct PREFIX ## _tree_t *tree,                                               \
+                     KEY_TYPE key)                                                                       \
+{                                                                                                        \
+    VALUE_TYPE res = ZERO_INIT(VALUE_TYPE);                                                              \
+    struct PREFIX ## _tree_node_t *result_node;                                                          \
+    if (PREFIX ## _tree_lookup (tree, key, &result_node)) {                                              \
+        res = result_node->value;                                                                        \
+    }                                                                                                    \
+                                                                                                         \
+    return res;                                                                                          \
+}
+
+
 #define BINARY_TREE_NEW(PREFIX,KEY_TYPE,VALUE_TYPE,CMP_A_TO_B)                                           \
                                                                                                          \
 struct PREFIX ## _tree_t {                                                                               \
@@ -9,6 +76,9 @@ struct PREFIX ## _tree_t {
     mem_pool_t *pool;                                                                                    \
                                                                                                          \
     uint32_t num_nodes;                                                                                  \
+    /*Number of nodes in the longest path from the root, BINARY_TREE_FOR uses                            \
+    it to size its stack.*/                                                                              \
+    uint32_t height;                                                                                     \
                                                                                                          \
     struct PREFIX ## _tree_node_t *root;                                                                 \
 };                                                                                                       \
@@ -52,8 +122,10 @@ void PREFIX ## _tree_insert (struct PREFIX ## _tree_t *tree, KEY_TYPE key, VALUE
                                                                                                          \
         tree->root = new_node;                                                                           \
         tree->num_nodes++;                                                                               \
+        tree->height = 1;                                                                                \
                                                                                                          \
     } else {                                                                                             \
+        uint32_t depth = 1;                                                                              \
         struct PREFIX ## _tree_node_t **curr_node = &tree->root;                                         \
         while (!key_found && *curr_node != NULL) {                                                       \
             KEY_TYPE a = key;                                                                            \
@@ -61,9 +133,11 @@ void PREFIX ## _tree_insert (struct PREFIX ## _tree_t *tree, KEY_TYPE key, VALUE
             int c = CMP_A_TO_B;                                                                          \
             if (c < 0) {                                                                                 \
                 curr_node = &(*curr_node)->left;                                                         \
+                depth++;                                                                                 \
                                                                                                          \
             } else if (c > 0) {                                                                          \
                 curr_node = &(*curr_node)->right;                                                        \
+                depth++;                                                                                 \
                                                                                                          \
             } else {                                                                                     \
                 /* Key already exists. Options of what we could do here:
@@ -87,78 +161,252 @@ void PREFIX ## _tree_insert (struct PREFIX ## _tree_t *tree, KEY_TYPE key, VALUE
             (*curr_node)->value = value;                                                                 \
                                                                                                          \
             tree->num_nodes++;                                                                           \
+            tree->height = MAX (tree->height, depth);                                                    \
         }                                                                                                \
                                                                                                          \
         /* TODO: Rebalance the tree.*/                                                                   \
     }                                                                                                    \
 }                                                                                                        \
                                                                                                          \
-bool PREFIX ## _tree_lookup (struct PREFIX ## _tree_t *tree,                                             \
-                             KEY_TYPE key,                                                               \
-                             struct PREFIX ## _tree_node_t **result)                                     \
+BINARY_TREE_COMMON_FUNCTIONS(PREFIX,KEY_TYPE,VALUE_TYPE,CMP_A_TO_B)
+
+// AVL tree variant with the same API as BINARY_TREE_NEW, plus node removal.
+// Lookups stay O(log n) regardless of the insertion order, which matters when
+// keys are inserted already sorted. Removed nodes are kept in a free list and
+// reused by later insertions.
+#define BINARY_TREE_NEW_BALANCED(PREFIX,KEY_TYPE,VALUE_TYPE,CMP_A_TO_B)                                  \
+                                                                                                         \
+struct PREFIX ## _tree_t {                                                                               \
+    mem_pool_t _pool;                                                                                    \
+    mem_pool_t *pool;                                                                                    \
+                                                                                                         \
+    uint32_t num_nodes;                                                                                  \
+    /*Number of nodes in the longest path from the root, BINARY_TREE_FOR uses                            \
+    it to size its stack.*/                                                                              \
+    uint32_t height;                                                                                     \
+                                                                                                         \
+    struct PREFIX ## _tree_node_t *root;                                                                 \
+                                                                                                         \
+    /*Linked through the right pointer.*/                                                                \
+    struct PREFIX ## _tree_node_t *free_nodes;                                                           \
+};                                                                                                       \
+                                                                                                         \
+/*Leftmost node will be the smallest.*/                                                                  \
+struct PREFIX ## _tree_node_t {                                                                          \
+    KEY_TYPE key;                                                                                        \
+                                                                                                         \
+    VALUE_TYPE value;                                                                                    \
+                                                                                                         \
+    struct PREFIX ## _tree_node_t *right;                                                                \
+    struct PREFIX ## _tree_node_t *left;                                                                 \
+                                                                                                         \
+    /*Height of the subtree rooted at this node, leaves have height 1.*/                                 \
+    int height;                                                                                          \
+};                                                                                                       \
+                                                                                                         \
+void PREFIX ## _tree_destroy (struct PREFIX ## _tree_t *tree)                                            \
 {                                                                                                        \
-    bool key_found = false;                                                                              \
-    struct PREFIX ## _tree_node_t **curr_node = &tree->root;                                             \
-    while (*curr_node != NULL) {                                                                         \
-        KEY_TYPE a = key;                                                                                \
-        KEY_TYPE b = (*curr_node)->key;                                                                  \
-        int c = CMP_A_TO_B;                                                                              \
-        if (c < 0) {                                                                                     \
-            curr_node = &(*curr_node)->left;                                                             \
+    /*Only destroy our own pool*/                                                                        \
+    mem_pool_destroy (&tree->_pool);                                                                     \
+}                                                                                                        \
                                                                                                          \
-        } else if (c > 0) {                                                                              \
-            curr_node = &(*curr_node)->right;                                                            \
+struct PREFIX ## _tree_node_t* PREFIX ## _tree_allocate_node (struct PREFIX ## _tree_t *tree)            \
+{                                                                                                        \
+    /*If pool pointer is null we use our own pool, the user must call _destroy*/                         \
+    if (tree->pool == NULL) tree->pool = &tree->_pool;                                                   \
                                                                                                          \
-        } else {                                                                                         \
-            key_found = true;                                                                            \
-            break;                                                                                       \
-        }                                                                                                \
+    struct PREFIX ## _tree_node_t *new_node = tree->free_nodes;                                          \
+    if (new_node != NULL) {                                                                              \
+        tree->free_nodes = new_node->right;                                                              \
+    } else {                                                                                             \
+        new_node = mem_pool_push_struct (tree->pool, struct PREFIX ## _tree_node_t);                     \
     }                                                                                                    \
+    *new_node = ZERO_INIT(struct PREFIX ## _tree_node_t);                                                \
+    new_node->height = 1;                                                                                \
+    return new_node;                                                                                     \
+}                                                                                                        \
                                                                                                          \
-    if (result != NULL) {                                                                                \
-        if (key_found) {                                                                                 \
-            *result = *curr_node;                                                                        \
-        } else {                                                                                         \
-            *result = NULL;                                                                              \
+static inline                                                                                            \
+int PREFIX ## _tree_height (struct PREFIX ## _tree_node_t *node)                                         \
+{                                                                                                        \
+    return node != NULL ? node->height : 0;                                                              \
+}                                                                                                        \
+                                                                                                         \
+static inline                                                                                            \
+void PREFIX ## _tree_update_height (struct PREFIX ## _tree_node_t *node)                                 \
+{                                                                                                        \
+    node->height = 1 + MAX (PREFIX ## _tree_height (node->left), PREFIX ## _tree_height (node->right));  \
+}                                                                                                        \
+                                                                                                         \
+static inline                                                                                            \
+struct PREFIX ## _tree_node_t* PREFIX ## _tree_rotate_right (struct PREFIX ## _tree_node_t *node)        \
+{                                                                                                        \
+    struct PREFIX ## _tree_node_t *new_root = node->left;                                                \
+    node->left = new_root->right;                                                                        \
+    new_root->right = node;                                                                              \
+    PREFIX ## _tree_update_height (node);                                                                \
+    PREFIX ## _tree_update_height (new_root);                                                            \
+    return new_root;                                                                                     \
+}                                                                                                        \
+                                                                                                         \
+static inline                                                                                            \
+struct PREFIX ## _tree_node_t* PREFIX ## _tree_rotate_left (struct PREFIX ## _tree_node_t *node)         \
+{                                                                                                        \
+    struct PREFIX ## _tree_node_t *new_root = node->right;                                               \
+    node->right = new_root->left;                                                                        \
+    new_root->left = node;                                                                               \
+    PREFIX ## _tree_update_height (node);                                                                \
+    PREFIX ## _tree_update_height (new_root);                                                            \
+    return new_root;                                                                                     \
+}                                                                                                        \
+                                                                                                         \
+/*Restores the AVL property at node, assuming its subtrees are balanced and                              \
+their heights differ by at most 2. Returns the new root of the subtree.*/                                \
+struct PREFIX ## _tree_node_t* PREFIX ## _tree_rebalance (struct PREFIX ## _tree_node_t *node)           \
+{                                                                                                        \
+    PREFIX ## _tree_update_height (node);                                                                \
+    int balance = PREFIX ## _tree_height (node->left) - PREFIX ## _tree_height (node->right);            \
+                                                                                                         \
+    if (balance > 1) {                                                                                   \
+        if (PREFIX ## _tree_height (node->left->left) < PREFIX ## _tree_height (node->left->right)) {    \
+            node->left = PREFIX ## _tree_rotate_left (node->left);                                       \
         }                                                                                                \
+        node = PREFIX ## _tree_rotate_right (node);                                                      \
+                                                                                                         \
+    } else if (balance < -1) {                                                                           \
+        if (PREFIX ## _tree_height (node->right->right) < PREFIX ## _tree_height (node->right->left)) {  \
+            node->right = PREFIX ## _tree_rotate_right (node->right);                                    \
+        }                                                                                                \
+        node = PREFIX ## _tree_rotate_left (node);                                                       \
     }                                                                                                    \
                                                                                                          \
-    return key_found;                                                                                    \
+    return node;                                                                                         \
 }                                                                                                        \
                                                                                                          \
-bool PREFIX ## _maybe_get (struct PREFIX ## _tree_t *tree,                                               \
-                           KEY_TYPE key, VALUE_TYPE *value)                                              \
+struct PREFIX ## _tree_node_t* PREFIX ## _tree_insert_node (struct PREFIX ## _tree_t *tree,              \
+                                                            struct PREFIX ## _tree_node_t *node,         \
+                                                            KEY_TYPE key, VALUE_TYPE value)              \
 {                                                                                                        \
-    struct PREFIX ## _tree_node_t *result_node;                                                          \
-    if (PREFIX ## _tree_lookup (tree, key, &result_node)) {                                              \
-        *value = result_node->value;                                                                     \
-        return true;                                                                                     \
+    if (node == NULL) {                                                                                  \
+        struct PREFIX ## _tree_node_t *new_node = PREFIX ## _tree_allocate_node (tree);                  \
+        new_node->key = key;                                                                             \
+        new_node->value = value;                                                                         \
+                                                                                                         \
+        tree->num_nodes++;                                                                               \
+        return new_node;                                                                                 \
     }                                                                                                    \
                                                                                                          \
-    return false;                                                                                        \
+    KEY_TYPE a = key;                                                                                    \
+    KEY_TYPE b = node->key;                                                                              \
+    int c = CMP_A_TO_B;                                                                                  \
+    if (c < 0) {                                                                                         \
+        node->left = PREFIX ## _tree_insert_node (tree, node->left, key, value);                         \
+                                                                                                         \
+    } else if (c > 0) {                                                                                  \
+        node->right = PREFIX ## _tree_insert_node (tree, node->right, key, value);                       \
+                                                                                                         \
+    } else {                                                                                             \
+        /*Key already exists, do nothing like BINARY_TREE_NEW.*/                                         \
+        return node;                                                                                     \
+    }                                                                                                    \
+                                                                                                         \
+    return PREFIX ## _tree_rebalance (node);                                                             \
 }                                                                                                        \
                                                                                                          \
-/*
- * This is only a convenience function. A zeroed out value will be returned
- * if the key is not found. There is no way to differentiate a zeroed out
- * stored value from a non existing key, use *_tree_lookup() for that.
- */                                                                                                      \
-VALUE_TYPE PREFIX ## _get (struct PREFIX ## _tree_t *tree,                                               \
-                     KEY_TYPE key)                                                                       \
+void PREFIX ## _tree_insert (struct PREFIX ## _tree_t *tree, KEY_TYPE key, VALUE_TYPE value)             \
 {                                                                                                        \
-    VALUE_TYPE res = ZERO_INIT(VALUE_TYPE);                                                              \
-    struct PREFIX ## _tree_node_t *result_node;                                                          \
-    if (PREFIX ## _tree_lookup (tree, key, &result_node)) {                                              \
-        res = result_node->value;                                                                        \
+    tree->root = PREFIX ## _tree_insert_node (tree, tree->root, key, value);                             \
+    tree->height = PREFIX ## _tree_height (tree->root);                                                  \
+}                                                                                                        \
+                                                                                                         \
+/*Unlinks the smallest node of the subtree rooted at node and stores it in min.*/                        \
+struct PREFIX ## _tree_node_t* PREFIX ## _tree_remove_min (struct PREFIX ## _tree_node_t *node,          \
+                                                           struct PREFIX ## _tree_node_t **min)          \
+{                                                                                                        \
+    if (node->left == NULL) {                                                                            \
+        *min = node;                                                                                     \
+        return node->right;                                                                              \
     }                                                                                                    \
                                                                                                          \
-    return res;                                                                                          \
-}
-
+    node->left = PREFIX ## _tree_remove_min (node->left, min);                                           \
+    return PREFIX ## _tree_rebalance (node);                                                             \
+}                                                                                                        \
+                                                                                                         \
+struct PREFIX ## _tree_node_t* PREFIX ## _tree_remove_node (struct PREFIX ## _tree_t *tree,              \
+                                                            struct PREFIX ## _tree_node_t *node,         \
+                                                            KEY_TYPE key,                                \
+                                                            struct PREFIX ## _tree_node_t *removed)      \
+{                                                                                                        \
+    if (node == NULL) return NULL;                                                                       \
+                                                                                                         \
+    KEY_TYPE a = key;                                                                                    \
+    KEY_TYPE b = node->key;                                                                              \
+    int c = CMP_A_TO_B;                                                                                  \
+    if (c < 0) {                                                                                         \
+        node->left = PREFIX ## _tree_remove_node (tree, node->left, key, removed);                       \
+                                                                                                         \
+    } else if (c > 0) {                                                                                  \
+        node->right = PREFIX ## _tree_remove_node (tree, node->right, key, removed);                     \
+                                                                                                         \
+    } else {                                                                                             \
+        *removed = *node;                                                                                \
+        tree->num_nodes--;                                                                               \
+                                                                                                         \
+        struct PREFIX ## _tree_node_t *replacement;                                                      \
+        if (node->left == NULL || node->right == NULL) {                                                 \
+            replacement = node->left != NULL ? node->left : node->right;                                 \
+                                                                                                         \
+        } else {                                                                                         \
+            struct PREFIX ## _tree_node_t *right;                                                        \
+            right = PREFIX ## _tree_remove_min (node->right, &replacement);                              \
+            replacement->left = node->left;                                                              \
+            replacement->right = right;                                                                  \
+        }                                                                                                \
+                                                                                                         \
+        node->left = NULL;                                                                               \
+        node->right = tree->free_nodes;                                                                  \
+        tree->free_nodes = node;                                                                         \
+                                                                                                         \
+        if (replacement == NULL) return NULL;                                                            \
+        node = replacement;                                                                              \
+    }                                                                                                    \
+                                                                                                         \
+    return PREFIX ## _tree_rebalance (node);                                                             \
+}                                                                                                        \
+                                                                                                         \
+/*Returns false if key wasn't in the tree. The removed key and value are                                 \
+stored in removed_key and removed_value if they aren't NULL, so the caller can                           \
+free them.*/                                                                                             \
+bool PREFIX ## _tree_remove (struct PREFIX ## _tree_t *tree, KEY_TYPE key,                               \
+                             KEY_TYPE *removed_key, VALUE_TYPE *removed_value)                           \
+{                                                                                                        \
+    uint32_t num_nodes = tree->num_nodes;                                                                \
+    struct PREFIX ## _tree_node_t removed;                                                               \
+    tree->root = PREFIX ## _tree_remove_node (tree, tree->root, key, &removed);                          \
+    tree->height = PREFIX ## _tree_height (tree->root);                                                  \
+                                                                                                         \
+    if (tree->num_nodes == num_nodes) return false;                                                      \
+                                                                                                         \
+    if (removed_key != NULL) *removed_key = removed.key;                                                 \
+    if (removed_value != NULL) *removed_value = removed.value;                                           \
+    return true;                                                                                         \
+}                                                                                                        \
+                                                                                                         \
+BINARY_TREE_COMMON_FUNCTIONS(PREFIX,KEY_TYPE,VALUE_TYPE,CMP_A_TO_B)
 
+// In order traversal of the tree. The stack of pending nodes can't be deeper
+// than the height of the tree, it's kept in a local buffer declared along
+// with VARNAME unless the tree is taller than BINARY_TREE_FOR_STACK_SIZE. A
+// balanced tree needs more than 5 million nodes for that, so in practice
+// iterating doesn't allocate.
+//
+// NOTE: Breaking out of the loop leaks the stack if it was allocated.
+#define BINARY_TREE_FOR_STACK_SIZE 32
 #define BINARY_TREE_FOR(PREFIX,TREE,VARNAME)                                                             \
                                                                                                          \
 struct PREFIX ## _tree_node_t *VARNAME = (TREE)->root;                                                   \
+/*Not in the loop context, its initializer would zero the whole buffer.*/                                \
+struct PREFIX ## _tree_node_t *VARNAME ## _buffer[BINARY_TREE_FOR_STACK_SIZE];                           \
 for (struct {                                                                                            \
          bool break_needed;                                                                              \
          bool visit_node;                                                                                \
@@ -168,7 +416,9 @@ for (struct {
          false,                                                                                          \
          false,                                                                                          \
          0,                                                                                              \
-         malloc ((TREE)->num_nodes*sizeof(struct PREFIX ## _tree_node_t))                                \
+         (TREE)->height <= BINARY_TREE_FOR_STACK_SIZE ?                                                  \
+             VARNAME ## _buffer :                                                                        \
+             malloc ((TREE)->height*sizeof(struct PREFIX ## _tree_node_t*))                              \
      };                                                                                                  \
                                                                                                          \
      _loop_ctx.break_needed = false,                                                                     \
@@ -186,7 +436,8 @@ for (struct {
              0),                                                                                         \
         0)                                                                                               \
      ),                                                                                                  \
-     _loop_ctx.break_needed ? free (_loop_ctx.stack), false : true;                                      \
+     _loop_ctx.break_needed ?                                                                            \
+         (_loop_ctx.stack != VARNAME ## _buffer ? free (_loop_ctx.stack) : (void)0), false : true;       \
                                                                                                          \
      _loop_ctx.visit_node ?                                                                              \
          (VARNAME = VARNAME->right, 0) : 0)                                                              \
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
@@ -785,6 +786,30 @@ void restore_locale (char *old_locale)
     free (old_locale);
 }
 
+////////////
+// HASHING
+//
+// 64 bit FNV-1a hash. It's not cryptographic, but it's simple and good enough
+// to detect changes in file contents or as a hash table hash. The _update
+// version allows hashing data that isn't contiguous in memory, by passing the
+// result of a previous call as the hash argument.
+#define FNV1A_64_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV1A_64_PRIME 0x100000001b3ULL
+
+static inline
+uint64_t fnv1a_64_update (uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *byte = (const uint8_t*)data;
+    for (size_t i=0; i<len; i++) {
+        hash ^= byte[i];
+        hash *= FNV1A_64_PRIME;
+    }
+    return hash;
+}
+
+#define fnv1a_64(data,len) fnv1a_64_update(FNV1A_64_OFFSET_BASIS,data,len)
+#define fnv1a_64_str(c_str) fnv1a_64(c_str,strlen(c_str))
+
 #define VECT_X 0
 #define VECT_Y 1
 #define VECT_Z 2
@@ -2767,6 +2792,96 @@ char* full_file_read (mem_pool_t *pool, const char *path, uint64_t *len)
     return retval;
 }
 
+struct pooled_file_map_t {
+    void *addr;
+    size_t size;
+};
+
+ON_DESTROY_CALLBACK (destroy_pooled_file_map)
+{
+    struct pooled_file_map_t *map = (struct pooled_file_map_t*)allocated;
+    munmap (map->addr, map->size);
+}
+
+// Maps size bytes of the open file fd read only, followed by a '\0'. Bytes
+// after the end of the file in its last page are zero, so usually the
+// terminator comes for free. If the size is a multiple of the page size there
+// is no such byte, then the file is mapped over an anonymous mapping one page
+// larger, which reads as zeros.
+//
+// Returns NULL and sets errno on failure, otherwise the size of the mapping
+// to be passed to munmap() is stored in map_size.
+char* file_map (int fd, uint64_t size, size_t *map_size)
+{
+    size_t page_size = sysconf (_SC_PAGESIZE);
+    *map_size = (size/page_size + 1)*page_size;
+
+    void *addr = MAP_FAILED;
+    if (size % page_size != 0) {
+        addr = mmap (NULL, *map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    } else {
+        addr = mmap (NULL, *map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr != MAP_FAILED && size > 0 &&
+            mmap (addr, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            int error = errno;
+            munmap (addr, *map_size);
+            errno = error;
+            addr = MAP_FAILED;
+        }
+    }
+
+    if (addr == MAP_FAILED) return NULL;
+
+    madvise (addr, *map_size, MADV_SEQUENTIAL);
+    return (char*)addr;
+}
+
+// Like full_file_read() but the file is mapped read only with file_map()
+// instead of copied, so the data lives in the page cache. The mapping is
+// released when the pool is destroyed, or when a temporary memory marker
+// taken before the call ends.
+//
+// CAUTION: Accessing the mapping after the file is truncated by someone else
+// raises SIGBUS.
+char* full_file_map (mem_pool_t *pool, const char *path, uint64_t *len)
+{
+    assert (pool != NULL);
+
+    int file = open (path, O_RDONLY);
+    if (file == -1) {
+        printf ("Error opening %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    char *retval = NULL;
+    struct stat st;
+    if (fstat (file, &st) == 0) {
+        size_t map_size;
+        char *addr = file_map (file, st.st_size, &map_size);
+        if (addr != NULL) {
+            struct pooled_file_map_t *map =
+                mem_pool_push_size_cb (pool, sizeof(struct pooled_file_map_t), destroy_pooled_file_map);
+            map->addr = addr;
+            map->size = map_size;
+
+            retval = addr;
+            if (len != NULL) {
+                *len = st.st_size;
+            }
+
+        } else {
+            printf ("Error mapping %s: %s\n", path, strerror(errno));
+        }
+
+    } else {
+        printf ("Could not read %s: %s\n", path, strerror(errno));
+    }
+
+    close (file);
+    return retval;
+}
+
 bool path_exists (char *path)
 {
     if (path == NULL) return false;
@@ -3589,5 +3704,175 @@ head_name[head_name ## _len - 1]
 }                                                                           \
 type name = (head_name) + ((head_name ## _len)++);
 
+///////////////////
+//
+//  HASH MAP
+//
+// Open addressing hash map with linear probing. Entries are stored contiguously
+// in insertion order, the probed table only holds 32 bit hashes and entry
+// indices, so a lookup usually touches a single cache line before comparing
+// keys. The table is kept at most half full.
+//
+// HASH_KEY is an expression computing a 64 bit hash of a variable named key,
+// KEY_EQUALS compares variables a and b. STORE_KEY is the key that will be
+// stored in the map when inserting key, it can use the variable pool to copy
+// keys into the map's pool. See CSTR_HASH_MAP_NEW for an example.
+//
+// Memory is handled as in BINARY_TREE_NEW, if the pool pointer is NULL the map
+// uses its own pool and the user must call _map_destroy(). Tables are
+// allocated in the pool, when they grow the old ones are left there. Because
+// the size doubles each time, these never add up to more than the final size.
+//
+// Also like BINARY_TREE_NEW, inserting a key that already exists does nothing.
+#define HASH_MAP_NEW(PREFIX,KEY_TYPE,VALUE_TYPE,HASH_KEY,KEY_EQUALS,STORE_KEY)                           \
+                                                                                                         \
+struct PREFIX ## _map_entry_t {                                                                          \
+    KEY_TYPE key;                                                                                        \
+    VALUE_TYPE value;                                                                                    \
+};                                                                                                       \
+                                                                                                         \
+/*entry is the index in the entries array plus 1, 0 marks an empty slot.*/                               \
+struct PREFIX ## _map_slot_t {                                                                           \
+    uint32_t hash;                                                                                       \
+    uint32_t entry;                                                                                      \
+};                                                                                                       \
+                                                                                                         \
+struct PREFIX ## _map_t {                                                                                \
+    mem_pool_t _pool;                                                                                    \
+    mem_pool_t *pool;                                                                                    \
+                                                                                                         \
+    uint32_t num_entries;                                                                                \
+    uint32_t capacity;                                                                                   \
+                                                                                                         \
+    struct PREFIX ## _map_slot_t *slots;                                                                 \
+    struct PREFIX ## _map_entry_t *entries;                                                              \
+};                                                                                                       \
+                                                                                                         \
+void PREFIX ## _map_destroy (struct PREFIX ## _map_t *map)                                               \
+{                                                                                                        \
+    /*Only destroy our own pool*/                                                                        \
+    mem_pool_destroy (&map->_pool);                                                                      \
+}                                                                                                        \
+                                                                                                         \
+static inline                                                                                            \
+uint32_t PREFIX ## _map_hash (KEY_TYPE key)                                                              \
+{                                                                                                        \
+    return (uint32_t)(HASH_KEY);                                                                         \
+}                                                                                                        \
+                                                                                                         \
+/*Returns the index of the slot containing key, or of the empty slot where it
+should be inserted.*/                                                                                    \
+uint32_t PREFIX ## _map_find_slot (struct PREFIX ## _map_t *map, uint32_t hash, KEY_TYPE key)            \
+{                                                                                                        \
+    uint32_t mask = map->capacity - 1;                                                                   \
+    uint32_t i = hash & mask;                                                                            \
+    while (map->slots[i].entry != 0) {                                                                   \
+        if (map->slots[i].hash == hash) {                                                                \
+            KEY_TYPE a = key;                                                                            \
+            KEY_TYPE b = map->entries[map->slots[i].entry - 1].key;                                      \
+            if (KEY_EQUALS) break;                                                                       \
+        }                                                                                                \
+        i = (i + 1) & mask;                                                                              \
+    }                                                                                                    \
+                                                                                                         \
+    return i;                                                                                            \
+}                                                                                                        \
+                                                                                                         \
+void PREFIX ## _map_grow (struct PREFIX ## _map_t *map)                                                  \
+{                                                                                                        \
+    /*If pool pointer is null we use our own pool, the user must call _destroy*/                         \
+    if (map->pool == NULL) map->pool = &map->_pool;                                                      \
+                                                                                                         \
+    uint32_t old_capacity = map->capacity;                                                               \
+    struct PREFIX ## _map_slot_t *old_slots = map->slots;                                                \
+    struct PREFIX ## _map_entry_t *old_entries = map->entries;                                           \
+                                                                                                         \
+    map->capacity = old_capacity == 0 ? 16 : 2*old_capacity;                                             \
+    map->slots = mem_pool_push_array (map->pool, map->capacity, struct PREFIX ## _map_slot_t);           \
+    memset (map->slots, 0, map->capacity*sizeof(struct PREFIX ## _map_slot_t));                          \
+    map->entries = mem_pool_push_array (map->pool, map->capacity/2, struct PREFIX ## _map_entry_t);      \
+    if (map->num_entries > 0) {                                                                          \
+        memcpy (map->entries, old_entries, map->num_entries*sizeof(struct PREFIX ## _map_entry_t));      \
+    }                                                                                                    \
+                                                                                                         \
+    /*Entries are unique, so we only need to find an empty slot.*/                                       \
+    uint32_t mask = map->capacity - 1;                                                                   \
+    for (uint32_t i=0; i<old_capacity; i++) {                                                            \
+        if (old_slots[i].entry != 0) {                                                                   \
+            uint32_t j = old_slots[i].hash & mask;                                                       \
+            while (map->slots[j].entry != 0) j = (j + 1) & mask;                                         \
+            map->slots[j] = old_slots[i];                                                                \
+        }                                                                                                \
+    }                                                                                                    \
+}                                                                                                        \
+                                                                                                         \
+void PREFIX ## _map_insert (struct PREFIX ## _map_t *map, KEY_TYPE key, VALUE_TYPE value)                \
+{                                                                                                        \
+    if (2*(map->num_entries + 1) > map->capacity) {                                                      \
+        PREFIX ## _map_grow (map);                                                                       \
+    }                                                                                                    \
+                                                                                                         \
+    uint32_t hash = PREFIX ## _map_hash (key);                                                           \
+    uint32_t i = PREFIX ## _map_find_slot (map, hash, key);                                              \
+    if (map->slots[i].entry == 0) {                                                                      \
+        mem_pool_t *pool = map->pool; (void)pool; /*STORE_KEY may not use it*/                           \
+        struct PREFIX ## _map_entry_t *entry = &map->entries[map->num_entries++];                        \
+        entry->key = STORE_KEY;                                                                          \
+        entry->value = value;                                                                            \
+                                                                                                         \
+        map->slots[i].hash = hash;                                                                       \
+        map->slots[i].entry = map->num_entries;                                                          \
+    }                                                                                                    \
+}                                                                                                        \
+                                                                                                         \
+bool PREFIX ## _map_lookup (struct PREFIX ## _map_t *map,                                                \
+                            KEY_TYPE key,                                                                \
+                            struct PREFIX ## _map_entry_t **result)                                      \
+{                                                                                                        \
+    struct PREFIX ## _map_entry_t *entry = NULL;                                                         \
+    if (map->num_entries > 0) {                                                                          \
+        uint32_t i = PREFIX ## _map_find_slot (map, PREFIX ## _map_hash (key), key);                     \
+        if (map->slots[i].entry != 0) {                                                                  \
+            entry = &map->entries[map->slots[i].entry - 1];                                              \
+        }                                                                                                \
+    }                                                                                                    \
+                                                                                                         \
+    if (result != NULL) {                                                                                \
+        *result = entry;                                                                                 \
+    }                                                                                                    \
+                                                                                                         \
+    return entry != NULL;                                                                                \
+}                                                                                                        \
+                                                                                                         \
+bool PREFIX ## _map_maybe_get (struct PREFIX ## _map_t *map, KEY_TYPE key, VALUE_TYPE *value)            \
+{                                                                                                        \
+    struct PREFIX ## _map_entry_t *entry;                                                                \
+    if (PREFIX ## _map_lookup (map, key, &entry)) {                                                      \
+        *value = entry->value;                                                                           \
+        return true;                                                                                     \
+    }                                                                                                    \
+                                                                                                         \
+    return false;                                                                                        \
+}                                                                                                        \
+                                                                                                         \
+/* A zeroed out value is returned if the key is not found, use *_map_lookup()
+to differentiate it from a stored zeroed out value.*/                                                    \
+VALUE_TYPE PREFIX ## _map_get (struct PREFIX ## _map_t *map, KEY_TYPE key)                               \
+{                                                                                                        \
+    VALUE_TYPE res = ZERO_INIT(VALUE_TYPE);                                                              \
+    PREFIX ## _map_maybe_get (map, key, &res);                                                           \
+    return res;                                                                                          \
+}
+
+// Iterates entries in insertion order.
+#define HASH_MAP_FOR(PREFIX,MAP,VARNAME)                                                                 \
+for (struct PREFIX ## _map_entry_t *VARNAME = (MAP)->entries;                                            \
+     VARNAME != NULL && VARNAME < (MAP)->entries + (MAP)->num_entries;                                   \
+     VARNAME++)
+
+// Map with NULL terminated string keys, these are copied into the map's pool.
+#define CSTR_HASH_MAP_NEW(PREFIX,VALUE_TYPE) \
+    HASH_MAP_NEW(PREFIX, char*, VALUE_TYPE, fnv1a_64_str(key), strcmp(a, b) == 0, pom_strdup(pool, key))
+
 #define COMMON_H
 #endif
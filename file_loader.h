@@ -0,0 +1,487 @@
+/*
+ * Copyright (C) 2021 Santiago León O.
+ */
+
+// Bulk loader that reads a list of files concurrently and hands each one to
+// the caller as soon as its read completes. Reading notes one after the other
+// is bound by the latency of each read when the page cache is cold, keeping
+// many reads in flight lets the device serve them in parallel while the
+// caller parses the ones that already arrived.
+//
+// Files aren't copied, each one is mapped with file_map() and the read is
+// faulting in the pages of the mapping with MADV_POPULATE_READ, so the caller
+// gets page cache memory that won't block when accessed. The madvise() calls
+// are submitted in batches to an io_uring, if the kernel doesn't support it or
+// it's disabled (seccomp filters usually return EPERM or ENOSYS) a pool of
+// threads calling madvise() is used instead. Opening and mapping files is done
+// synchronously by the loader, callers usually stat() the files before anyway
+// so their metadata is already cached.
+//
+// Usage:
+//
+//  struct file_loader_t loader = {0};
+//  file_loader_add (&loader, path, data);
+//  ...
+//  file_loader_start (&loader);
+//
+//  struct file_load_t *file;
+//  while ((file = file_loader_next (&loader)) != NULL) {
+//      // file->content is read only and NUL terminated, NULL if the file
+//      // couldn't be read.
+//      file_loader_release (&loader, file);
+//  }
+//
+//  file_loader_destroy (&loader);
+//
+// file_loader_next() can be called from multiple threads. At most max_buffers
+// files are loaded but not yet released, so memory usage stays bounded no
+// matter how many files are read.
+
+#include <pthread.h>
+
+#define FILE_LOADER_QUEUE_DEPTH 64
+
+struct file_load_t {
+    char *path;
+    void *data;
+
+    char *content;
+    uint64_t len;
+
+    int fd;
+    size_t map_size;
+    uint64_t populated;
+    struct file_load_t *next_done;
+
+    struct file_load_t *next;
+};
+
+struct file_loader_ring_t {
+    int fd;
+    uint32_t entries;
+
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+struct file_loader_t {
+    mem_pool_t pool;
+
+    // Maximum number of files loaded and not yet released, defaults to
+    // FILE_LOADER_QUEUE_DEPTH.
+    int max_buffers;
+    bool disable_io_uring;
+
+    struct file_load_t *files;
+    struct file_load_t *files_end;
+    int num_files;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+    pthread_cond_t free_cond;
+
+    // Reading threads advance pending through the list of files, each file
+    // is appended to done when its read completes.
+    struct file_load_t *pending;
+    struct file_load_t *done;
+    struct file_load_t *done_end;
+    int num_taken;
+    int num_buffers;
+
+    bool use_io_uring;
+    struct file_loader_ring_t ring;
+
+    int num_threads;
+    pthread_t *threads;
+};
+
+#if defined(FILE_LOADER_IMPL)
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+#if !defined(MADV_POPULATE_READ)
+#define MADV_POPULATE_READ 22
+#endif
+
+// The length of an io_uring request is 32 bits, larger files are populated in
+// chunks of this size.
+#define FILE_LOADER_CHUNK_SIZE (1U << 30)
+
+void file_loader_add (struct file_loader_t *loader, char *path, void *data)
+{
+    LINKED_LIST_APPEND_NEW (&loader->pool, struct file_load_t, loader->files, new_file);
+    new_file->path = path;
+    new_file->data = data;
+    new_file->fd = -1;
+    loader->num_files++;
+}
+
+// Takes the next file to be read, blocks while max_buffers files are loaded
+// and not released. Returns NULL when all files have been taken.
+struct file_load_t* file_loader_take (struct file_loader_t *loader, bool block)
+{
+    struct file_load_t *file = NULL;
+
+    pthread_mutex_lock (&loader->mutex);
+    while (block && loader->pending != NULL && loader->num_buffers >= loader->max_buffers) {
+        pthread_cond_wait (&loader->free_cond, &loader->mutex);
+    }
+
+    if (loader->pending != NULL && loader->num_buffers < loader->max_buffers) {
+        file = loader->pending;
+        loader->pending = file->next;
+        loader->num_buffers++;
+    }
+    pthread_mutex_unlock (&loader->mutex);
+
+    return file;
+}
+
+void file_loader_complete (struct file_loader_t *loader, struct file_load_t *file, int error)
+{
+    if (file->fd != -1) {
+        close (file->fd);
+        file->fd = -1;
+    }
+
+    if (error != 0) {
+        printf ("Error reading %s: %s\n", file->path, strerror(error));
+        if (file->content != NULL) munmap (file->content, file->map_size);
+        file->content = NULL;
+        file->len = 0;
+    }
+
+    pthread_mutex_lock (&loader->mutex);
+    if (loader->done_end == NULL) {
+        loader->done = file;
+    } else {
+        loader->done_end->next_done = file;
+    }
+    loader->done_end = file;
+    pthread_cond_signal (&loader->done_cond);
+    pthread_mutex_unlock (&loader->mutex);
+}
+
+// Opens and maps file. Returns 0 on success or the errno of the failed call.
+int file_loader_open (struct file_load_t *file)
+{
+    file->fd = open (file->path, O_RDONLY);
+    if (file->fd == -1) return errno;
+
+    struct stat st;
+    if (fstat (file->fd, &st) == -1) return errno;
+
+    file->content = file_map (file->fd, st.st_size, &file->map_size);
+    if (file->content == NULL) return errno;
+
+    file->len = st.st_size;
+    file->populated = 0;
+
+    return 0;
+}
+
+// Faults in the rest of the pages of file's mapping. MADV_POPULATE_READ is
+// available since Linux 5.14, in older kernels the pages are touched one by
+// one instead.
+int file_loader_populate (struct file_load_t *file)
+{
+    while (file->populated < file->len) {
+        uint64_t size = file->len - file->populated;
+        if (madvise (file->content + file->populated, size, MADV_POPULATE_READ) == 0) {
+            file->populated += size;
+
+        } else if (errno == EINVAL) {
+            size_t page_size = sysconf (_SC_PAGESIZE);
+            for (; file->populated < file->len; file->populated += page_size) {
+                (void)*(volatile char*)(file->content + file->populated);
+            }
+
+        } else if (errno != EINTR) {
+            return errno;
+        }
+    }
+
+    return 0;
+}
+
+void* file_loader_populate_thread (void *data)
+{
+    struct file_loader_t *loader = (struct file_loader_t*)data;
+
+    struct file_load_t *file;
+    while ((file = file_loader_take (loader, true)) != NULL) {
+        int error = file_loader_open (file);
+        if (error == 0) {
+            error = file_loader_populate (file);
+        }
+
+        file_loader_complete (loader, file, error);
+    }
+
+    return NULL;
+}
+
+bool file_loader_ring_init (struct file_loader_ring_t *ring, uint32_t entries)
+{
+    struct io_uring_params params = {0};
+    ring->fd = syscall (__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) return false;
+
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries*sizeof(uint32_t);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+
+    // Since Linux 5.4 both rings live in a single mapping.
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        ring->sq_size = MAX (ring->sq_size, ring->cq_size);
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap (NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = ring->sq_ptr;
+    if (!single_mmap && ring->sq_ptr != MAP_FAILED) {
+        ring->cq_ptr = mmap (NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQES);
+
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ptr != MAP_FAILED) munmap (ring->sq_ptr, ring->sq_size);
+        if (!single_mmap && ring->cq_ptr != MAP_FAILED) munmap (ring->cq_ptr, ring->cq_size);
+        if (ring->sqes != MAP_FAILED) munmap (ring->sqes, ring->sqes_size);
+        close (ring->fd);
+        return false;
+    }
+
+    char *sq = (char*)ring->sq_ptr;
+    ring->sq_head = (uint32_t*)(sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+    ring->sq_mask = (uint32_t*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t*)(sq + params.sq_off.array);
+
+    char *cq = (char*)ring->cq_ptr;
+    ring->cq_head = (uint32_t*)(cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+    ring->cq_mask = (uint32_t*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+void file_loader_ring_destroy (struct file_loader_ring_t *ring)
+{
+    munmap (ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr) munmap (ring->cq_ptr, ring->cq_size);
+    munmap (ring->sq_ptr, ring->sq_size);
+    close (ring->fd);
+}
+
+// Queues populating the next chunk of file's mapping, it's submitted by the
+// next call to io_uring_enter().
+void file_loader_ring_push_populate (struct file_loader_ring_t *ring, struct file_load_t *file)
+{
+    uint32_t tail = *ring->sq_tail;
+    uint32_t idx = tail & *ring->sq_mask;
+
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset (sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_MADVISE;
+    sqe->addr = (uintptr_t)(file->content + file->populated);
+    sqe->len = MIN (file->len - file->populated, FILE_LOADER_CHUNK_SIZE);
+    sqe->fadvise_advice = MADV_POPULATE_READ;
+    sqe->user_data = (uintptr_t)file;
+
+    ring->sq_array[idx] = idx;
+    __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void* file_loader_ring_thread (void *data)
+{
+    struct file_loader_t *loader = (struct file_loader_t*)data;
+    struct file_loader_ring_t *ring = &loader->ring;
+
+    uint32_t in_flight = 0;
+    uint32_t to_submit = 0;
+    bool has_pending = true;
+    while (has_pending || in_flight > 0) {
+        // Fill the submission queue. Only block waiting for a buffer to be
+        // released if there is nothing to wait for in the ring.
+        while (has_pending && in_flight < ring->entries) {
+            struct file_load_t *file = file_loader_take (loader, in_flight == 0);
+            if (file == NULL) {
+                pthread_mutex_lock (&loader->mutex);
+                has_pending = loader->pending != NULL;
+                pthread_mutex_unlock (&loader->mutex);
+                break;
+            }
+
+            int error = file_loader_open (file);
+            if (error != 0 || file->len == 0) {
+                file_loader_complete (loader, file, error);
+
+            } else {
+                file_loader_ring_push_populate (ring, file);
+                in_flight++;
+                to_submit++;
+            }
+        }
+
+        if (in_flight == 0) continue;
+
+        int status = syscall (__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (status == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+
+            // The ring is unusable. Reads in flight are failed, unmapping
+            // them is safe because the kernel only reads the mappings. The
+            // rest of the files are populated with madvise().
+            printf ("Error waiting for reads: %s\n", strerror(errno));
+            LINKED_LIST_FOR (struct file_load_t*, file, loader->files) {
+                if (file->fd != -1) {
+                    file_loader_complete (loader, file, EIO);
+                }
+            }
+            return file_loader_populate_thread (loader);
+        }
+        to_submit -= status < (int)to_submit ? status : to_submit;
+
+        uint32_t head = *ring->cq_head;
+        uint32_t tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            struct file_load_t *file = (struct file_load_t*)(uintptr_t)cqe->user_data;
+
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+                file_loader_ring_push_populate (ring, file);
+                to_submit++;
+
+            } else if (cqe->res == -EINVAL) {
+                // Kernels before 5.14 don't know MADV_POPULATE_READ.
+                in_flight--;
+                file_loader_complete (loader, file, file_loader_populate (file));
+
+            } else if (cqe->res < 0) {
+                in_flight--;
+                file_loader_complete (loader, file, -cqe->res);
+
+            } else {
+                file->populated += MIN (file->len - file->populated, FILE_LOADER_CHUNK_SIZE);
+                if (file->populated < file->len) {
+                    file_loader_ring_push_populate (ring, file);
+                    to_submit++;
+
+                } else {
+                    in_flight--;
+                    file_loader_complete (loader, file, 0);
+                }
+            }
+        }
+        __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+// Starts reading all files added with file_loader_add() in the background.
+void file_loader_start (struct file_loader_t *loader)
+{
+    if (loader->max_buffers <= 0) {
+        loader->max_buffers = FILE_LOADER_QUEUE_DEPTH;
+    }
+
+    pthread_mutex_init (&loader->mutex, NULL);
+    pthread_cond_init (&loader->done_cond, NULL);
+    pthread_cond_init (&loader->free_cond, NULL);
+    loader->pending = loader->files;
+
+    if (!loader->disable_io_uring) {
+        loader->use_io_uring = file_loader_ring_init (&loader->ring, loader->max_buffers);
+    }
+
+    loader->num_threads = loader->use_io_uring ? 1 : MIN (loader->max_buffers, FILE_LOADER_QUEUE_DEPTH);
+    loader->threads = mem_pool_push_array (&loader->pool, loader->num_threads, pthread_t);
+    for (int i=0; i<loader->num_threads; i++) {
+        pthread_create (&loader->threads[i], NULL,
+                        loader->use_io_uring ? file_loader_ring_thread : file_loader_populate_thread,
+                        loader);
+    }
+}
+
+// Returns the next file that finished loading, blocks until there is one.
+// Returns NULL after all files were returned.
+struct file_load_t* file_loader_next (struct file_loader_t *loader)
+{
+    struct file_load_t *file = NULL;
+
+    pthread_mutex_lock (&loader->mutex);
+    while (loader->done == NULL && loader->num_taken < loader->num_files) {
+        pthread_cond_wait (&loader->done_cond, &loader->mutex);
+    }
+
+    if (loader->done != NULL) {
+        file = loader->done;
+        loader->done = file->next_done;
+        if (loader->done == NULL) loader->done_end = NULL;
+        loader->num_taken++;
+    }
+
+    // Wake up other consumers once everything was taken.
+    if (loader->num_taken == loader->num_files) {
+        pthread_cond_broadcast (&loader->done_cond);
+    }
+    pthread_mutex_unlock (&loader->mutex);
+
+    return file;
+}
+
+// Unmaps the content of file so another file can be loaded.
+void file_loader_release (struct file_loader_t *loader, struct file_load_t *file)
+{
+    if (file->content != NULL) munmap (file->content, file->map_size);
+    file->content = NULL;
+
+    pthread_mutex_lock (&loader->mutex);
+    loader->num_buffers--;
+    pthread_cond_signal (&loader->free_cond);
+    pthread_mutex_unlock (&loader->mutex);
+}
+
+void file_loader_destroy (struct file_loader_t *loader)
+{
+    for (int i=0; i<loader->num_threads; i++) {
+        pthread_join (loader->threads[i], NULL);
+    }
+
+    if (loader->use_io_uring) {
+        file_loader_ring_destroy (&loader->ring);
+    }
+
+    if (loader->threads != NULL) {
+        pthread_mutex_destroy (&loader->mutex);
+        pthread_cond_destroy (&loader->done_cond);
+        pthread_cond_destroy (&loader->free_cond);
+    }
+
+    mem_pool_destroy (&loader->pool);
+}
+
+#endif
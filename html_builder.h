@@ -2,15 +2,111 @@
  * Copyright (C) 2021 Santiago León O.
  */
 
-BINARY_TREE_NEW(attribute_map, string_t, string_t, strcmp(str_data(&a),str_data(&b)))
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Tag and attribute names are interned, elements store them as small integer
+// ids called atoms. Names used by the parser are predefined in
+// HTML_ATOMS_TABLE along with the properties of tags the writer needs, so
+// checking them is a table lookup. Other names are interned in the html_t the
+// first time they are used, their atoms start at HTML_NUM_ATOMS.
+#define HTML_ATOM_INLINE (1<<0)
+#define HTML_ATOM_VOID   (1<<1)
+
+#define HTML_ATOMS_TABLE                                                  \
+    HTML_ATOMS_ROW(HTML_ATOM_NONE,            "",                0)                \
+    HTML_ATOMS_ROW(HTML_TAG_A,                "a",               HTML_ATOM_INLINE) \
+    HTML_ATOMS_ROW(HTML_TAG_AREA,             "area",            HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_B,                "b",               HTML_ATOM_INLINE) \
+    HTML_ATOMS_ROW(HTML_TAG_BASE,             "base",            HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_BR,               "br",              HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_CODE,             "code",            0)                \
+    HTML_ATOMS_ROW(HTML_TAG_COL,              "col",             HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_DIV,              "div",             0)                \
+    HTML_ATOMS_ROW(HTML_TAG_EMBED,            "embed",           HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_H1,               "h1",              0)                \
+    HTML_ATOMS_ROW(HTML_TAG_H2,               "h2",              0)                \
+    HTML_ATOMS_ROW(HTML_TAG_H3,               "h3",              0)                \
+    HTML_ATOMS_ROW(HTML_TAG_H4,               "h4",              0)                \
+    HTML_ATOMS_ROW(HTML_TAG_H5,               "h5",              0)                \
+    HTML_ATOMS_ROW(HTML_TAG_H6,               "h6",              0)                \
+    HTML_ATOMS_ROW(HTML_TAG_HR,               "hr",              HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_I,                "i",               HTML_ATOM_INLINE) \
+    HTML_ATOMS_ROW(HTML_TAG_IFRAME,           "iframe",          0)                \
+    HTML_ATOMS_ROW(HTML_TAG_IMG,              "img",             HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_INPUT,            "input",           HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_LI,               "li",              0)                \
+    HTML_ATOMS_ROW(HTML_TAG_LINK,             "link",            HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_META,             "meta",            HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_OL,               "ol",              0)                \
+    HTML_ATOMS_ROW(HTML_TAG_P,                "p",               HTML_ATOM_INLINE) \
+    HTML_ATOMS_ROW(HTML_TAG_PARAM,            "param",           HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_PRE,              "pre",             HTML_ATOM_INLINE) \
+    HTML_ATOMS_ROW(HTML_TAG_SOURCE,           "source",          HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_SPAN,             "span",            0)                \
+    HTML_ATOMS_ROW(HTML_TAG_TRACK,            "track",           HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_TAG_UL,               "ul",              0)                \
+    HTML_ATOMS_ROW(HTML_TAG_WBR,              "wbr",             HTML_ATOM_VOID)   \
+    HTML_ATOMS_ROW(HTML_ATTR_ALLOW,           "allow",           0)                \
+    HTML_ATOMS_ROW(HTML_ATTR_ALLOWFULLSCREEN, "allowfullscreen", 0)                \
+    HTML_ATOMS_ROW(HTML_ATTR_CLASS,           "class",           0)                \
+    HTML_ATOMS_ROW(HTML_ATTR_FRAMEBORDER,     "frameborder",     0)                \
+    HTML_ATOMS_ROW(HTML_ATTR_HEIGHT,          "height",          0)                \
+    HTML_ATOMS_ROW(HTML_ATTR_HREF,            "href",            0)                \
+    HTML_ATOMS_ROW(HTML_ATTR_ID,              "id",              0)                \
+    HTML_ATOMS_ROW(HTML_ATTR_ONCLICK,         "onclick",         0)                \
+    HTML_ATOMS_ROW(HTML_ATTR_SRC,             "src",             0)                \
+    HTML_ATOMS_ROW(HTML_ATTR_STYLE,           "style",           0)                \
+    HTML_ATOMS_ROW(HTML_ATTR_TARGET,          "target",          0)                \
+    HTML_ATOMS_ROW(HTML_ATTR_WIDTH,           "width",           0)
+
+#define HTML_ATOMS_ROW(atom,name,flags) atom,
+enum html_atom_t {
+    HTML_ATOMS_TABLE
+    HTML_NUM_ATOMS
+};
+#undef HTML_ATOMS_ROW
+
+struct html_name_t {
+    char *s;
+    size_t len;
+};
+
+#define HTML_ATOMS_ROW(atom,name,flags) {name, sizeof(name) - 1},
+struct html_name_t html_atom_names[] = {
+    HTML_ATOMS_TABLE
+};
+#undef HTML_ATOMS_ROW
+
+#define HTML_ATOMS_ROW(atom,name,flags) flags,
+uint8_t html_atom_flags[] = {
+    HTML_ATOMS_TABLE
+};
+#undef HTML_ATOMS_ROW
+
+HASH_MAP_NEW (html_atom, struct html_name_t, uint32_t,
+              fnv1a_64(key.s, key.len),
+              a.len == b.len && memcmp(a.s, b.s, a.len) == 0,
+              ((struct html_name_t){pom_strndup(pool, key.s, key.len), key.len}))
+
+// Attributes are keyed by their interned name, which is never copied into the
+// tree. They are written in the order of the tree, alphabetically, regardless
+// of the order they were set in.
+BINARY_TREE_NEW_BALANCED(attribute_map, struct html_name_t, string_t, strcmp(a.s, b.s))
 
 struct html_element_t {
-    string_t tag;
+    uint32_t tag;
     struct attribute_map_tree_t attributes;
 
     struct html_element_t *next;
 
     string_t text;
+    // Text of raw nodes is already HTML and is written without escaping.
+    bool is_raw;
+
     struct html_element_t *children;
     struct html_element_t *children_end;
 };
@@ -21,6 +117,10 @@ struct html_t {
 
     struct html_element_t *element_fl;
 
+    // Names that aren't in HTML_ATOMS_TABLE, the atom of each one is
+    // HTML_NUM_ATOMS plus its position in the map.
+    struct html_atom_map_t atoms;
+
     struct html_element_t *root;
 };
 
@@ -36,6 +136,64 @@ void html_destroy (struct html_t *html)
     }                                  \
 }
 
+// The map of predefined names is built the first time a name is interned,
+// then it's only read, so it's shared by all threads.
+struct html_atom_map_t html_predefined_atoms = {0};
+pthread_once_t html_predefined_atoms_once = PTHREAD_ONCE_INIT;
+
+void html_predefined_atoms_init ()
+{
+    for (uint32_t atom=0; atom<HTML_NUM_ATOMS; atom++) {
+        html_atom_map_insert (&html_predefined_atoms, html_atom_names[atom], atom);
+    }
+}
+
+uint32_t html_atom_strn (struct html_t *html, size_t len, char *name)
+{
+    pthread_once (&html_predefined_atoms_once, html_predefined_atoms_init);
+
+    struct html_name_t key = {name, len};
+    uint32_t atom;
+    if (html_atom_map_maybe_get (&html_predefined_atoms, key, &atom)) {
+        return atom;
+    }
+
+    mem_pool_variable_ensure (html);
+    html->atoms.pool = html->pool;
+    if (!html_atom_map_maybe_get (&html->atoms, key, &atom)) {
+        atom = HTML_NUM_ATOMS + html->atoms.num_entries;
+        html_atom_map_insert (&html->atoms, key, atom);
+    }
+
+    return atom;
+}
+
+static inline
+struct html_name_t html_atom_name (struct html_t *html, uint32_t atom)
+{
+    if (atom < HTML_NUM_ATOMS) {
+        return html_atom_names[atom];
+    } else {
+        return html->atoms.entries[atom - HTML_NUM_ATOMS].key;
+    }
+}
+
+void html_element_free_strings (struct html_element_t *element)
+{
+    str_free (&element->text);
+    BINARY_TREE_FOR (attribute_map, &element->attributes, attr_node) {
+        str_free (&attr_node->value);
+    }
+}
+
+// Strings inside elements are malloc'ed, free them when the pool where the
+// element was allocated gets destroyed. This way a whole html_t can be cleared
+// by resetting its pool with mem_pool_end_temporary_memory().
+ON_DESTROY_CALLBACK (destroy_html_element)
+{
+    html_element_free_strings ((struct html_element_t*)allocated);
+}
+
 struct html_element_t* html_new_node (struct html_t *html)
 {
     mem_pool_variable_ensure (html);
@@ -43,11 +201,14 @@ struct html_element_t* html_new_node (struct html_t *html)
     struct html_element_t *new_element = NULL;
     if (html->element_fl != NULL) {
         new_element = LINKED_LIST_POP (html->element_fl);
+        html_element_free_strings (new_element);
+
     } else {
-        new_element = mem_pool_push_struct (html->pool, struct html_element_t);
+        new_element = mem_pool_push_size_cb (html->pool, sizeof(struct html_element_t), destroy_html_element);
     }
 
     *new_element = ZERO_INIT (struct html_element_t);
+    new_element->attributes.pool = html->pool;
 
     return new_element;
 }
@@ -57,7 +218,7 @@ struct html_element_t* html_new_element_strn (struct html_t *html, ssize_t len,
 {
     struct html_element_t *new_element = html_new_node (html);
 
-    strn_set (&new_element->tag, tag_name, len);
+    new_element->tag = html_atom_strn (html, len, tag_name);
 
     if (html->root == NULL) {
         html->root = new_element;
@@ -93,47 +254,63 @@ void html_element_append_strn (struct html_t *html, struct html_element_t *html_
     LINKED_LIST_APPEND (html_element->children, new_text_node);
 }
 
+// Appends text that will be written verbatim, it must be valid HTML.
+void html_element_append_raw_strn (struct html_t *html, struct html_element_t *html_element, size_t len, char *text)
+{
+    struct html_element_t *new_text_node = html_new_node (html);
+    strn_set (&new_text_node->text, text, len);
+    new_text_node->is_raw = true;
+    LINKED_LIST_APPEND (html_element->children, new_text_node);
+}
+
+string_t* html_element_attribute_get (struct html_t *html, struct html_element_t *html_element, uint32_t name)
+{
+    struct attribute_map_tree_node_t *node;
+    attribute_map_tree_lookup (&html_element->attributes, html_atom_name (html, name), &node);
+    return node != NULL ? &node->value : NULL;
+}
+
 void html_element_attribute_set (struct html_t *html, struct html_element_t *html_element, char *attribute, char *value)
 {
     mem_pool_variable_ensure (html);
 
-    string_t attribute_str = {0};
-    str_set (&attribute_str, attribute);
+    struct html_name_t name = html_atom_name (html, html_atom_strn (html, strlen(attribute), attribute));
 
     struct attribute_map_tree_node_t *node;
-    attribute_map_tree_lookup (&html_element->attributes, attribute_str, &node);
+    attribute_map_tree_lookup (&html_element->attributes, name, &node);
     if (node == NULL) {
-        //str_pool (html->pool, &attribute_str);
-
         string_t value_str = {0};
         str_set (&value_str, value);
-        //str_pool (html->pool, &value_str);
 
-        attribute_map_tree_insert (&html_element->attributes, attribute_str, value_str);
+        attribute_map_tree_insert (&html_element->attributes, name, value_str);
 
     } else {
         str_set (&node->value, value);
     }
 }
 
+void html_element_attribute_remove (struct html_t *html, struct html_element_t *html_element, char *attribute)
+{
+    struct html_name_t name = html_atom_name (html, html_atom_strn (html, strlen(attribute), attribute));
+
+    struct html_name_t key;
+    string_t value;
+    if (attribute_map_tree_remove (&html_element->attributes, name, &key, &value)) {
+        str_free (&value);
+    }
+}
+
 // NOTE: Don't pass multiple comma-separated classes as value, instead call this
 // function multiple times.
 void html_element_class_add (struct html_t *html, struct html_element_t *html_element, char *value)
 {
-    mem_pool_variable_ensure (html);
-
-    string_t attr = {0};
-    str_set (&attr, "class");
-
-    struct attribute_map_tree_node_t *node;
-    attribute_map_tree_lookup (&html_element->attributes, attr, &node);
-    if (node == NULL) {
-        html_element_attribute_set (html, html_element, str_data(&attr), value);
+    string_t *classes = html_element_attribute_get (html, html_element, HTML_ATTR_CLASS);
+    if (classes == NULL) {
+        html_element_attribute_set (html, html_element, "class", value);
 
     } else {
-        str_cat_printf (&node->value, ",%s", value);
+        str_cat_printf (classes, ",%s", value);
     }
-    str_free (&attr);
 }
 
 static inline
@@ -145,45 +322,215 @@ bool html_element_is_text_node (struct html_element_t *element)
 static inline
 bool html_is_inline_tag (struct html_element_t *element)
 {
-    char *inline_tags[] = {"pre", "p", "i", "b", "a"};
-    for (int i=0; i<ARRAY_SIZE(inline_tags); i++) {
-        if (strcmp(str_data(&element->tag), inline_tags[i]) == 0) return true;
-    }
-    return false;
+    return element->tag < HTML_NUM_ATOMS && (html_atom_flags[element->tag] & HTML_ATOM_INLINE);
 }
 
 static inline
 bool html_is_void_element (struct html_element_t *element)
 {
-    char *void_elemens[] = {"area", "base", "br", "col", "embed", "hr", "img", "input", "link", "meta", "param", "source", "track", "wbr"};
-    for (int i=0; i<ARRAY_SIZE(void_elemens); i++) {
-        if (strcmp(str_data(&element->tag), void_elemens[i]) == 0) return true;
+    return element->tag < HTML_NUM_ATOMS && (html_atom_flags[element->tag] & HTML_ATOM_VOID);
+}
+
+// Serialization writes into a fixed size buffer that is passed to a callback
+// each time it fills up, so output is produced in constant memory regardless
+// of the size of the document. The callback returns false to signal an
+// error, after that no more output is produced.
+#define HTML_WRITE_CB(name) bool name(void *data, const char *buffer, size_t len)
+typedef HTML_WRITE_CB(html_write_cb_t);
+
+#define HTML_WRITER_BUFFER_SIZE kilobyte(16)
+
+struct html_writer_t {
+    struct html_t *html;
+
+    html_write_cb_t *cb;
+    void *cb_data;
+    bool error;
+
+    size_t len;
+    char buffer[HTML_WRITER_BUFFER_SIZE];
+};
+
+static inline
+void html_writer_init (struct html_writer_t *w, struct html_t *html, html_write_cb_t *cb, void *data)
+{
+    w->html = html;
+    w->cb = cb;
+    w->cb_data = data;
+    w->error = false;
+    w->len = 0;
+}
+
+void html_writer_flush (struct html_writer_t *w)
+{
+    if (!w->error && w->len > 0) {
+        w->error = !w->cb (w->cb_data, w->buffer, w->len);
+    }
+    w->len = 0;
+}
+
+void html_writer_write (struct html_writer_t *w, const char *data, size_t len)
+{
+    if (w->len + len > HTML_WRITER_BUFFER_SIZE) {
+        html_writer_flush (w);
+
+        // Chunks that don't fit in the buffer are passed to the callback
+        // directly instead of being copied.
+        if (len > HTML_WRITER_BUFFER_SIZE) {
+            if (!w->error) {
+                w->error = !w->cb (w->cb_data, data, len);
+            }
+            return;
+        }
+    }
+
+    memcpy (w->buffer + w->len, data, len);
+    w->len += len;
+}
+
+#define html_writer_write_c(w,c_str) html_writer_write(w,c_str,strlen(c_str))
+
+// Returns the position of the first character in data that needs escaping,
+// or len if there is none. Text and attribute values are scanned for the
+// same set of characters, in text '"' is then copied as is. Attribute values
+// are always quoted with '"' so "'" never needs escaping.
+//
+// Most text doesn't contain any of these characters, so it's scanned 16 or
+// 32 bytes at a time and clean runs are copied in bulk.
+static inline
+size_t html_escape_scan (const char *data, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    __m256i lt = _mm256_set1_epi8 ('<');
+    __m256i gt = _mm256_set1_epi8 ('>');
+    __m256i amp = _mm256_set1_epi8 ('&');
+    __m256i quot = _mm256_set1_epi8 ('"');
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256 ((const __m256i*)(data + i));
+        __m256i found = _mm256_or_si256 (
+            _mm256_or_si256 (_mm256_cmpeq_epi8 (chunk, lt), _mm256_cmpeq_epi8 (chunk, gt)),
+            _mm256_or_si256 (_mm256_cmpeq_epi8 (chunk, amp), _mm256_cmpeq_epi8 (chunk, quot)));
+        uint32_t mask = _mm256_movemask_epi8 (found);
+        if (mask != 0) {
+            return i + __builtin_ctz (mask);
+        }
+    }
+#endif
+
+#if defined(__SSE2__)
+    __m128i lt_128 = _mm_set1_epi8 ('<');
+    __m128i gt_128 = _mm_set1_epi8 ('>');
+    __m128i amp_128 = _mm_set1_epi8 ('&');
+    __m128i quot_128 = _mm_set1_epi8 ('"');
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128 ((const __m128i*)(data + i));
+        __m128i found = _mm_or_si128 (
+            _mm_or_si128 (_mm_cmpeq_epi8 (chunk, lt_128), _mm_cmpeq_epi8 (chunk, gt_128)),
+            _mm_or_si128 (_mm_cmpeq_epi8 (chunk, amp_128), _mm_cmpeq_epi8 (chunk, quot_128)));
+        uint32_t mask = _mm_movemask_epi8 (found);
+        if (mask != 0) {
+            return i + __builtin_ctz (mask);
+        }
+    }
+#endif
+
+    for (; i < len; i++) {
+        char c = data[i];
+        if (c == '<' || c == '>' || c == '&' || c == '"') {
+            return i;
+        }
+    }
+
+    return len;
+}
+
+void html_writer_write_escaped (struct html_writer_t *w, const char *data, size_t len, bool is_attribute)
+{
+    size_t pos = 0;
+    while (pos < len) {
+        size_t run_len = html_escape_scan (data + pos, len - pos);
+        html_writer_write (w, data + pos, run_len);
+        pos += run_len;
+
+        if (pos < len) {
+            switch (data[pos]) {
+                case '<': html_writer_write_c (w, "&lt;"); break;
+                case '>': html_writer_write_c (w, "&gt;"); break;
+                case '&': html_writer_write_c (w, "&amp;"); break;
+                case '"':
+                    if (is_attribute) {
+                        html_writer_write_c (w, "&quot;");
+                    } else {
+                        html_writer_write (w, "\"", 1);
+                    }
+                    break;
+            }
+            pos++;
+        }
+    }
+}
+
+static inline
+void html_writer_indent (struct html_writer_t *w, int num_spaces)
+{
+    for (int i=0; i<num_spaces; i++) {
+        html_writer_write (w, " ", 1);
     }
-    return false;
 }
 
 static inline
-void html_maybe_cat_tag_end (string_t *str, struct html_element_t *element, int curr_indent)
+void html_writer_write_atom (struct html_writer_t *w, uint32_t atom)
+{
+    struct html_name_t name = html_atom_name (w->html, atom);
+    html_writer_write (w, name.s, name.len);
+}
+
+static inline
+void html_write_tag_end (struct html_writer_t *w, struct html_element_t *element, int curr_indent)
 {
     if (!html_is_void_element (element)) {
-        str_cat_indented_printf (str, curr_indent, "</%s>", str_data(&element->tag));
+        html_writer_indent (w, curr_indent);
+        html_writer_write_c (w, "</");
+        html_writer_write_atom (w, element->tag);
+        html_writer_write_c (w, ">");
     }
 }
 
-void str_cat_html_element (string_t *str, struct html_element_t *element, int indent, int curr_indent)
+// Line breaks are preceded by the current indentation, this is what
+// str_cat_indented_printf() did when this wrote into a string_t, keep it so
+// output doesn't change.
+static inline
+void html_write_line_break (struct html_writer_t *w, int curr_indent)
+{
+    html_writer_indent (w, curr_indent);
+    html_writer_write_c (w, "\n");
+}
+
+void html_write_element (struct html_writer_t *w, struct html_element_t *element, int indent, int curr_indent)
 {
     if (html_element_is_text_node (element)) {
-        str_cat (str, &element->text);
+        if (element->is_raw) {
+            html_writer_write (w, str_data(&element->text), str_len(&element->text));
+        } else {
+            html_writer_write_escaped (w, str_data(&element->text), str_len(&element->text), false);
+        }
 
     } else {
-        str_cat_indented_printf (str, curr_indent, "<%s", str_data(&element->tag));
-
-        BINARY_TREE_FOR(attribute_map, &element->attributes, attr_node)
-        {
-            str_cat_printf (str, " %s=\"%s\"", str_data(&attr_node->key), str_data(&attr_node->value));
+        html_writer_indent (w, curr_indent);
+        html_writer_write_c (w, "<");
+        html_writer_write_atom (w, element->tag);
+
+        BINARY_TREE_FOR (attribute_map, &element->attributes, attr_node) {
+            html_writer_write_c (w, " ");
+            html_writer_write (w, attr_node->key.s, attr_node->key.len);
+            html_writer_write_c (w, "=\"");
+            html_writer_write_escaped (w, str_data(&attr_node->value), str_len(&attr_node->value), true);
+            html_writer_write_c (w, "\"");
         }
 
-        str_cat_printf (str, ">");
+        html_writer_write_c (w, ">");
 
         if (element->children != NULL) {
             bool was_inlined = true;
@@ -191,34 +538,83 @@ void str_cat_html_element (string_t *str, struct html_element_t *element, int in
             {
                 if (!html_element_is_text_node (curr_child) && !html_is_inline_tag(element)) {
                     was_inlined = false;
-                    str_cat_indented_printf (str, curr_indent, "\n");
-                    str_cat_html_element (str, curr_child, indent, curr_indent+indent);
+                    html_write_line_break (w, curr_indent);
+                    html_write_element (w, curr_child, indent, curr_indent+indent);
 
                 } else {
-                    str_cat_html_element (str, curr_child, indent, 0);
+                    html_write_element (w, curr_child, indent, 0);
                 }
             }
 
             if (!was_inlined) {
-                str_cat_indented_printf (str, curr_indent, "\n");
-                html_maybe_cat_tag_end (str, element, curr_indent);
+                html_write_line_break (w, curr_indent);
+                html_write_tag_end (w, element, curr_indent);
 
             } else {
-                html_maybe_cat_tag_end (str, element, 0);
+                html_write_tag_end (w, element, 0);
             }
 
         } else {
-            html_maybe_cat_tag_end (str, element, 0);
+            html_write_tag_end (w, element, 0);
+        }
+    }
+}
+
+// Returns false if the callback returned false.
+bool html_write_cb (struct html_t *html, int indent, html_write_cb_t *cb, void *data)
+{
+    struct html_writer_t w;
+    html_writer_init (&w, html, cb, data);
+
+    html_write_element (&w, html->root, indent, 0);
+    html_writer_flush (&w);
+
+    return !w.error;
+}
+
+HTML_WRITE_CB (html_write_fd_cb)
+{
+    int fd = *(int*)data;
+
+    size_t bytes_written = 0;
+    while (bytes_written < len) {
+        ssize_t status = write (fd, buffer + bytes_written, len - bytes_written);
+        if (status == -1) {
+            if (errno == EINTR) continue;
+            return false;
         }
+        bytes_written += status;
     }
+
+    return true;
+}
+
+bool html_write_fd (struct html_t *html, int indent, int fd)
+{
+    return html_write_cb (html, indent, html_write_fd_cb, &fd);
+}
+
+HTML_WRITE_CB (html_write_str_cb)
+{
+    strn_cat_c ((string_t*)data, buffer, len);
+    return true;
+}
+
+void str_cat_html_element (string_t *str, struct html_t *html, struct html_element_t *element, int indent, int curr_indent)
+{
+    struct html_writer_t w;
+    html_writer_init (&w, html, html_write_str_cb, str);
+
+    html_write_element (&w, element, indent, curr_indent);
+    html_writer_flush (&w);
 }
 
 char* html_to_str (struct html_t *html, mem_pool_t *pool, int indent)
 {
     string_t result = {0};
 
-    str_cat_html_element (&result, html->root, indent, 0);
-    char *res = pom_strdup(pool, str_data(&result));
+    html_write_cb (html, indent, html_write_str_cb, &result);
+    char *res = pom_strndup(pool, str_data(&result), str_len(&result));
 
     str_free (&result);
 
@@ -49,14 +49,27 @@ struct Reclass {
 	Rune spans[64];
 };
 
+#define MAXLITERAL 32
+
 struct Reprog {
 	Reinst *start, *end;
 	int flags;
 	unsigned int nsub;
 	Reclass cclass[16];
+
+	/* Computed by regcomp() so regexec() can skip positions where a match
+	 * can't start. See analyze(). */
+	int anchored;
+	int hasfirst, firstbyte;
+	unsigned char first[256];
+	int nprefix;
+	char prefix[MAXLITERAL];
+	int nrequired;
+	char required[MAXLITERAL];
 };
 
-static struct {
+/* Parser state is thread local so regcomp() can be called concurrently. */
+static __thread struct {
 	Reprog *prog;
 	Renode *pstart, *pend;
 
@@ -504,6 +517,8 @@ static Renode *parseatom(void)
 		return atom;
 	}
 	if (g.lookahead == L_REF) {
+		if (g.prog->flags & REG_LINEAR)
+			die("back-references are not supported with REG_LINEAR");
 		atom = newnode(P_REF);
 		if (g.yychar == 0 || g.yychar > g.nsub || !g.sub[g.yychar])
 			die("invalid back-reference");
@@ -531,6 +546,10 @@ static Renode *parseatom(void)
 			die("unmatched '('");
 		return atom;
 	}
+	if (g.lookahead == L_PLA || g.lookahead == L_NLA) {
+		if (g.prog->flags & REG_LINEAR)
+			die("lookaheads are not supported with REG_LINEAR");
+	}
 	if (accept(L_PLA)) {
 		atom = newnode(P_PLA);
 		atom->x = parsealt();
@@ -837,10 +856,11 @@ static void dumpprog(Reprog *prog)
 }
 #endif
 
+static void analyze(Reprog *prog, Renode *node);
+
 Reprog *regcomp(const char *pattern, int cflags, const char **errorp)
 {
 	Renode *node;
-	Reinst *split, *jump;
 	int i, n;
 
 	g.pstart = NULL;
@@ -883,24 +903,20 @@ Reprog *regcomp(const char *pattern, int cflags, const char **errorp)
 	putchar('\n');
 #endif
 
-	n = 6 + count(node);
+	n = 3 + count(node);
 	if (n < 0 || n > MAXPROG)
 		die("program too large");
 
 	g.prog->nsub = g.nsub;
 	g.prog->start = g.prog->end = malloc(n * sizeof (Reinst));
 
-	split = emit(g.prog, I_SPLIT);
-	split->x = split + 3;
-	split->y = split + 1;
-	emit(g.prog, I_ANYNL);
-	jump = emit(g.prog, I_JUMP);
-	jump->x = split;
 	emit(g.prog, I_LPAR);
 	compile(g.prog, node);
 	emit(g.prog, I_RPAR);
 	emit(g.prog, I_END);
 
+	analyze(g.prog, node);
+
 #ifdef TEST
 	dumpprog(g.prog);
 #endif
@@ -1120,10 +1136,394 @@ static int match(Reinst *pc, const char *sp, const char *bol, int flags, Resub *
 	}
 }
 
-int regexec(Reprog *prog, const char *sp, Resub *sub, int eflags)
+/*
+ * Pike VM. All threads advance through the string in lockstep, one character
+ * at a time, so a match takes O(length of string * size of program) time
+ * regardless of the pattern. Threads are kept in priority order, the same
+ * order in which the backtracker would try them, so both return the same
+ * submatches. Back-references and lookaheads can't be matched like this,
+ * regcomp() rejects them when REG_LINEAR is set.
+ */
+
+typedef struct Relist Relist;
+
+struct Rethread {
+	Reinst *pc;
+	Resub sub;
+};
+
+struct Relist {
+	int n;
+	Rethread *t;
+};
+
+static int assertion(Reinst *pc, const char *sp, const char *bol, int flags)
 {
-	Resub scratch;
 	int i;
+	switch (pc->opcode) {
+	case I_BOL:
+		if (sp == bol && !(flags & REG_NOTBOL))
+			return 1;
+		return (flags & REG_NEWLINE) && sp > bol && isnewline(sp[-1]);
+	case I_EOL:
+		if (*sp == 0)
+			return 1;
+		return (flags & REG_NEWLINE) && isnewline(*sp);
+	case I_WORD:
+		i = sp > bol && iswordchar(sp[-1]);
+		i ^= iswordchar(sp[0]);
+		return i;
+	case I_NWORD:
+		i = sp > bol && iswordchar(sp[-1]);
+		i ^= iswordchar(sp[0]);
+		return !i;
+	}
+	return 0;
+}
+
+static int consume(Reinst *pc, Rune c, int flags)
+{
+	if (c == 0)
+		return 0;
+	switch (pc->opcode) {
+	case I_ANYNL:
+		return 1;
+	case I_ANY:
+		return !isnewline(c);
+	case I_CHAR:
+		if (flags & REG_ICASE)
+			c = canon(c);
+		return c == pc->c;
+	case I_CCLASS:
+		if (flags & REG_ICASE)
+			return incclasscanon(pc->cc, canon(c));
+		return incclass(pc->cc, c);
+	case I_NCCLASS:
+		if (flags & REG_ICASE)
+			return !incclasscanon(pc->cc, canon(c));
+		return !incclass(pc->cc, c);
+	}
+	return 0;
+}
+
+/*
+ * Start position analysis. A match can only start at the beginning of the
+ * string if the pattern is anchored with '^', only where its literal prefix
+ * appears, and only at a byte that can be the first one of a match. A literal
+ * that every match contains must appear somewhere in the string. This lets
+ * regexec() skip positions with strstr()/strchr() instead of entering the
+ * matcher at every byte.
+ */
+
+typedef struct Reliteral Reliteral;
+
+struct Reliteral {
+	Reprog *prog;
+	int inprefix;
+	int n;
+	char run[MAXLITERAL];
+};
+
+static int isanchored(Renode *node)
+{
+	if (!node) return 0;
+	switch (node->type) {
+	case P_BOL: return 1;
+	case P_CAT: return isanchored(node->x);
+	case P_ALT: return isanchored(node->x) && isanchored(node->y);
+	case P_PAR: return isanchored(node->x);
+	}
+	return 0;
+}
+
+static int bytematches(Renode *node, int b, int flags)
+{
+	Reinst inst;
+	char ch = b;
+	Rune c;
+
+	chartorune(&c, &ch);
+	switch (node->type) {
+	case P_ANY: inst.opcode = I_ANY; break;
+	case P_CHAR: inst.opcode = I_CHAR; break;
+	case P_CCLASS: inst.opcode = I_CCLASS; break;
+	default: inst.opcode = I_NCCLASS; break;
+	}
+	inst.c = (flags & REG_ICASE) ? canon(node->c) : node->c;
+	inst.cc = node->cc;
+	return consume(&inst, c, flags);
+}
+
+/* Marks in first the bytes that can start a match of node, returns 1 if node
+ * can match the empty string. */
+static int firstbytes(Renode *node, unsigned char *first, int flags)
+{
+	int b, x, y;
+	if (!node) return 1;
+	switch (node->type) {
+	case P_CAT:
+		if (!firstbytes(node->x, first, flags))
+			return 0;
+		return firstbytes(node->y, first, flags);
+	case P_ALT:
+		x = firstbytes(node->x, first, flags);
+		y = firstbytes(node->y, first, flags);
+		return x || y;
+	case P_REP:
+		x = firstbytes(node->x, first, flags);
+		return x || node->m == 0;
+	case P_PAR:
+		return firstbytes(node->x, first, flags);
+	case P_ANY: case P_CHAR: case P_CCLASS: case P_NCCLASS:
+		for (b = 1; b < 256; ++b)
+			if (bytematches(node, b, flags))
+				first[b] = 1;
+		return 0;
+	case P_REF:
+		for (b = 1; b < 256; ++b)
+			first[b] = 1;
+		return 1;
+	}
+	/* Assertions and lookaheads don't consume characters. */
+	return 1;
+}
+
+static void endrun(Reliteral *l)
+{
+	Reprog *prog = l->prog;
+	if (l->inprefix) {
+		memcpy(prog->prefix, l->run, l->n);
+		prog->prefix[l->n] = 0;
+		prog->nprefix = l->n;
+		l->inprefix = 0;
+	} else if (l->n > prog->nrequired && l->n > prog->nprefix) {
+		memcpy(prog->required, l->run, l->n);
+		prog->required[l->n] = 0;
+		prog->nrequired = l->n;
+	}
+	l->n = 0;
+}
+
+/* Collect runs of literal characters along the sequence of nodes every match
+ * goes through. Zero width nodes don't interrupt a run. Runs longer than
+ * MAXLITERAL are truncated, which still leaves a valid literal. */
+static void literals(Reliteral *l, Renode *node)
+{
+	if (!node) return;
+	switch (node->type) {
+	case P_CAT:
+		literals(l, node->x);
+		literals(l, node->y);
+		return;
+	case P_PAR:
+		literals(l, node->x);
+		return;
+	case P_BOL: case P_EOL: case P_WORD: case P_NWORD: case P_PLA: case P_NLA:
+		return;
+	case P_CHAR:
+		if (node->c > 0 && node->c < 128) {
+			if (l->n < MAXLITERAL - 1)
+				l->run[l->n++] = node->c;
+			return;
+		}
+		break;
+	}
+	endrun(l);
+}
+
+static void analyze(Reprog *prog, Renode *node)
+{
+	Reliteral l;
+	int b, n;
+
+	prog->anchored = !(prog->flags & REG_NEWLINE) && isanchored(node);
+
+	memset(prog->first, 0, sizeof prog->first);
+	prog->hasfirst = !firstbytes(node, prog->first, prog->flags);
+	prog->firstbyte = 0;
+	prog->nprefix = prog->nrequired = 0;
+
+	/* A pattern that matches the empty string can match at any position,
+	 * none of the rest applies to it. */
+	if (!prog->hasfirst)
+		return;
+
+	for (b = 1, n = 0; b < 256; ++b) {
+		if (prog->first[b]) {
+			prog->firstbyte = b;
+			n++;
+		}
+	}
+	if (n != 1)
+		prog->firstbyte = 0;
+
+	if (!(prog->flags & REG_ICASE)) {
+		l.prog = prog;
+		l.inprefix = 1;
+		l.n = 0;
+		literals(&l, node);
+		endrun(&l);
+	}
+}
+
+/* Returns the first position at or after sp where a match can start, or NULL
+ * if there is none. */
+static const char *nextstart(Reprog *prog, const char *sp, const char *bol)
+{
+	if (prog->anchored)
+		return sp == bol ? sp : NULL;
+	if (!prog->hasfirst)
+		return sp;
+	if (prog->nprefix > 0)
+		return strstr(sp, prog->prefix);
+	if (prog->firstbyte)
+		return strchr(sp, prog->firstbyte);
+	while (*sp && !prog->first[(unsigned char)*sp])
+		sp++;
+	return *sp ? sp : NULL;
+}
+
+static int canstart(Reprog *prog, const char *sp, const char *bol)
+{
+	if (prog->anchored)
+		return sp == bol;
+	if (!prog->hasfirst)
+		return 1;
+	if (prog->nprefix > 0)
+		return strncmp(sp, prog->prefix, prog->nprefix) == 0;
+	return prog->first[(unsigned char)*sp];
+}
+
+/* Add the thread at pc, following jumps, splits, captures and assertions at
+ * position sp. Each instruction is added at most once per step, mark holds
+ * the step in which it was last added. */
+static void addthread(Relist *l, Reinst *start, int *mark, int step, Reinst *pc, Resub *sub,
+	const char *sp, const char *bol, int flags)
+{
+	const char *save;
+
+	for (;;) {
+		if (mark[pc - start] == step)
+			return;
+		mark[pc - start] = step;
+
+		switch (pc->opcode) {
+		case I_JUMP:
+			pc = pc->x;
+			break;
+		case I_SPLIT:
+			addthread(l, start, mark, step, pc->x, sub, sp, bol, flags);
+			pc = pc->y;
+			break;
+		case I_LPAR:
+			save = sub->sub[pc->n].sp;
+			sub->sub[pc->n].sp = sp;
+			addthread(l, start, mark, step, pc + 1, sub, sp, bol, flags);
+			sub->sub[pc->n].sp = save;
+			return;
+		case I_RPAR:
+			save = sub->sub[pc->n].ep;
+			sub->sub[pc->n].ep = sp;
+			addthread(l, start, mark, step, pc + 1, sub, sp, bol, flags);
+			sub->sub[pc->n].ep = save;
+			return;
+		case I_BOL:
+		case I_EOL:
+		case I_WORD:
+		case I_NWORD:
+			if (!assertion(pc, sp, bol, flags))
+				return;
+			pc = pc + 1;
+			break;
+		default:
+			l->t[l->n].pc = pc;
+			l->t[l->n].sub = *sub;
+			l->n++;
+			return;
+		}
+	}
+}
+
+static int pikevm(Reprog *prog, const char *sp, const char *bol, int flags, Resub *out)
+{
+	int ninst = prog->end - prog->start;
+	int i, matched = 0, step = 0;
+	Relist clist, nlist, tmp;
+	Rethread *threads;
+	Resub empty;
+	int *mark;
+	const char *next;
+	Rune c;
+
+	threads = malloc(2 * ninst * sizeof (Rethread));
+	mark = malloc(ninst * sizeof (int));
+	if (!threads || !mark) {
+		free(threads);
+		free(mark);
+		return 0;
+	}
+	memset(mark, 0, ninst * sizeof (int));
+
+	clist.n = 0;
+	clist.t = threads;
+	nlist.n = 0;
+	nlist.t = threads + ninst;
+	empty = *out;
+
+	for (;;) {
+		/* Until there is a match, start a new thread with the lowest
+		 * priority at each position where a match can start. When no
+		 * threads are running skip directly to the next one. */
+		if (!matched) {
+			if (clist.n == 0) {
+				sp = nextstart(prog, sp, bol);
+				if (!sp)
+					break;
+				step++;
+				addthread(&clist, prog->start, mark, step, prog->start, &empty, sp, bol, flags);
+			} else if (canstart(prog, sp, bol)) {
+				addthread(&clist, prog->start, mark, step, prog->start, &empty, sp, bol, flags);
+			}
+		} else if (clist.n == 0) {
+			break;
+		}
+
+		next = sp + chartorune(&c, sp);
+		step++;
+
+		for (i = 0; i < clist.n; ++i) {
+			Rethread *t = &clist.t[i];
+			if (t->pc->opcode == I_END) {
+				/* Lower priority threads are cut off. */
+				*out = t->sub;
+				matched = 1;
+				break;
+			}
+			if (consume(t->pc, c, flags))
+				addthread(&nlist, prog->start, mark, step, t->pc + 1, &t->sub, next, bol, flags);
+		}
+
+		if (c == 0)
+			break;
+
+		tmp = clist;
+		clist = nlist;
+		nlist = tmp;
+		nlist.n = 0;
+		sp = next;
+	}
+
+	free(threads);
+	free(mark);
+	return matched;
+}
+
+int regexec(Reprog *prog, const char *sp, Resub *sub, int eflags)
+{
+	Resub scratch, m;
+	const char *bol = sp;
+	int i, flags = prog->flags | eflags;
+	Rune c;
 
 	if (!sub)
 		sub = &scratch;
@@ -1132,7 +1532,24 @@ int regexec(Reprog *prog, const char *sp, Resub *sub, int eflags)
 	for (i = 0; i < MAXSUB; ++i)
 		sub->sub[i].sp = sub->sub[i].ep = NULL;
 
-	return !match(prog->start, sp, sp, prog->flags | eflags, sub);
+	if (prog->nrequired > 0 && !strstr(sp, prog->required))
+		return 1;
+
+	if (flags & REG_LINEAR)
+		return !pikevm(prog, sp, bol, flags, sub);
+
+	while ((sp = nextstart(prog, sp, bol))) {
+		m = *sub;
+		if (match(prog->start, sp, bol, flags, &m)) {
+			*sub = m;
+			return 0;
+		}
+		if (*sp == 0)
+			break;
+		sp += chartorune(&c, sp);
+	}
+
+	return 1;
 }
 
 #ifdef TEST
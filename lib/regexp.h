@@ -16,6 +16,7 @@ enum {
 	/* regcomp flags */
 	REG_ICASE = 1,
 	REG_NEWLINE = 2,
+	REG_LINEAR = 8, /* match with a Pike VM, in linear time */
 
 	/* regexec flags */
 	REG_NOTBOL = 4,
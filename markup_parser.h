@@ -3,26 +3,91 @@
  */
 
 #include <limits.h>
+#include <pthread.h>
 #include "html_builder.h"
 #include "lib/regexp.h"
 #include "lib/regexp.c"
 
 int psx_content_width = 588; // px
 
-struct html_t* markup_to_html (mem_pool_t *pool, char *markup, char *id, int x);
+// Targets of \note{} and \summary{} tags found while rendering a note, in order
+// of appearance. These are collected during the same pass that builds the
+// HTML, so computing the note graph doesn't require searching every note for
+// every title.
+//
+// num_math counts \math{} and \Math{} tags, and num_missing_math the ones
+// that had to be rendered as TeX because their HTML wasn't available, see
+// psx_math_source_t.
+struct psx_link_t {
+    char *target;
 
-#if defined(MARKUP_PARSER_IMPL)
+    // The link comes from a \summary{} tag, so the rendered note includes
+    // content of the target, not only its title.
+    bool is_summary;
+
+    struct psx_link_t *next;
+};
+
+struct psx_note_links_t {
+    mem_pool_t *pool;
 
-//function UserTag (tag_name, callback, user_data) {
-//    this.name = tag_name;
-//    this.callback = callback;
-//    this.user_data = user_data;
-//}
+    int num_links;
+    struct psx_link_t *links;
+    struct psx_link_t *links_end;
+
+    int num_math;
+    int num_missing_math;
+};
+
+struct html_t* markup_to_html (mem_pool_t *pool, char *markup, char *id, int x);
+struct html_t* markup_to_html_full (mem_pool_t *pool, char *markup, char *id, int x,
+                                    struct psx_note_links_t *note_links);
+
+// Tags are rendered by callbacks looked up by the name of the tag. When a
+// callback is called ps->token is the tag, the callback parses the tag's
+// parameters and content from ps and appends the result to container, the
+// innermost element open where the tag was found. Callbacks whose result is
+// made of blocks, like \summary, can replace the whole block containing the
+// tag with psx_block_replace().
 //
-//function new_user_tag (tag_name, callback)
-//{
-//    __g_user_tags[tag_name] = new UserTag(tag_name, callback);
-//}
+// Built in tags are in PSX_TAGS_TABLE, psx_tag_register() adds a tag or
+// replaces the callback of an existing one. user_data is passed to the
+// callback on every call. Notes may be rendered by multiple threads at the
+// same time, so callbacks must be thread safe, and tags must be registered
+// before starting to render.
+struct psx_parser_state_t;
+#define PSX_TAG_CB(name) void name(struct psx_parser_state_t *ps, struct html_t *html, struct html_element_t *container, void *user_data)
+typedef PSX_TAG_CB(psx_tag_cb_t);
+
+bool psx_tag_register (char *name, psx_tag_cb_t *cb, void *user_data);
+
+// Provides the markup of other notes to tags that include their content. The
+// callback returns the markup of the note with the passed title allocated in
+// pool, or NULL if there's no such note. To expand \summary tags register
+// psx_tag_summary with a psx_note_source_t as user data, otherwise they are
+// rendered as links.
+#define PSX_GET_NOTE_CB(name) char* name(mem_pool_t *pool, char *title, void *data)
+typedef PSX_GET_NOTE_CB(psx_get_note_cb_t);
+
+struct psx_note_source_t {
+    psx_get_note_cb_t *get_note;
+    void *data;
+};
+
+// Provides math already rendered to HTML, so the client doesn't need to
+// typeset it. The callback returns the HTML of tex, which must stay valid
+// until the note is rendered, or NULL if it's not available. Register
+// psx_tag_math and psx_tag_math_display with a psx_math_source_t as user
+// data to use it.
+#define PSX_GET_MATH_CB(name) char* name(char *tex, bool display_mode, void *data)
+typedef PSX_GET_MATH_CB(psx_get_math_cb_t);
+
+struct psx_math_source_t {
+    psx_get_math_cb_t *get_math;
+    void *data;
+};
+
+#if defined(MARKUP_PARSER_IMPL)
 
 #define TOKEN_TYPES_TABLE                      \
     TOKEN_TYPES_ROW(TOKEN_TYPE_UNKNOWN)        \
@@ -64,15 +129,21 @@ sstring_t sstr_set (char *s, uint32_t len)
     return SSTRING(s, len);
 }
 
+static inline
+bool sstr_equals (sstring_t a, sstring_t b)
+{
+    return a.len == b.len && memcmp (a.s, b.s, a.len) == 0;
+}
+
 static inline
 sstring_t sstr_trim (sstring_t str)
 {
-    while (is_space (str.s)) {
+    while (str.len > 0 && (is_space (str.s) || *str.s == '\n')) {
         str.s++;
         str.len--;
     }
 
-    while (is_space (str.s + str.len - 1) || str.s[str.len - 1] == '\n') {
+    while (str.len > 0 && (is_space (str.s + str.len - 1) || str.s[str.len - 1] == '\n')) {
         str.len--;
     }
 
@@ -94,6 +165,30 @@ void sstr_extend (sstring_t *str1, sstring_t *str2)
     }
 }
 
+struct sstring_ll_l {
+    sstring_t v;
+    struct sstring_ll_l *next;
+};
+
+// Concatenates a list of strings, the destination grows only once.
+void str_cat_sstring_list (string_t *str, struct sstring_ll_l *list)
+{
+    size_t len = 0;
+    LINKED_LIST_FOR (struct sstring_ll_l*, curr_str, list) {
+        len += curr_str->v.len;
+    }
+
+    size_t old_len = str_len (str);
+    str_maybe_grow (str, old_len + len, true);
+
+    char *dst = str_data(str) + old_len;
+    LINKED_LIST_FOR (struct sstring_ll_l*, src, list) {
+        memcpy (dst, src->v.s, src->v.len);
+        dst += src->v.len;
+    }
+    *dst = '\0';
+}
+
 struct psx_token_t {
     sstring_t value;
 
@@ -128,7 +223,12 @@ struct psx_block_t {
     enum psx_block_type_t type;
     int margin;
 
-    string_t inline_content;
+    // Leaf blocks don't copy their content from the note, it's a list of spans
+    // into the note's text, so the text must outlive the block tree.
+    // Paragraphs and headings are a single span, code blocks have a span for
+    // each line.
+    struct sstring_ll_l *inline_content;
+    struct sstring_ll_l *inline_content_end;
 
     int heading_number;
 
@@ -162,21 +262,86 @@ struct psx_parser_state_t {
     char *pos;
     char *pos_peek;
 
+    // End of the text being parsed. When parsing a list of spans this is the
+    // end of the current one, otherwise it's the NUL terminator of the string.
+    // Scanners never read past it.
+    char *end;
+    struct sstring_ll_l *span;
+
     struct psx_token_t token;
     struct psx_token_t token_peek;
 
+    // Where tags that link to other notes are collected, can be NULL.
+    struct psx_note_links_t *note_links;
+
+    // Blocks set by psx_block_replace() to be rendered instead of the block
+    // being parsed. While they are rendered in_replacement is true.
+    struct psx_block_t *block_replacement;
+    bool in_replacement;
+
     DYNAMIC_ARRAY_DEFINE (struct psx_block_t*, block_stack);
     DYNAMIC_ARRAY_DEFINE (struct psx_block_unit_t*, block_unit_stack);
+
+    // State of the pool after ps_init(), ps_reset_spans() goes back to it.
+    mem_pool_marker_t pool_start;
 };
 
 void ps_init (struct psx_parser_state_t *ps, char *str)
 {
     ps->str = str;
     ps->pos = str;
+    ps->end = str + strlen(str);
 
     str_pool (&ps->pool, &ps->error_msg);
     DYNAMIC_ARRAY_INIT (&ps->pool, ps->block_stack, 100);
     DYNAMIC_ARRAY_INIT (&ps->pool, ps->block_unit_stack, 100);
+
+    ps->pool_start = mem_pool_begin_temporary_memory (&ps->pool);
+}
+
+// Parses a list of spans as if they were a single string, except that the end
+// of a span always ends the token being parsed. Tokens are only checked
+// against the end of the span when looking for EOF, so spans must not end in
+// spaces and the character after each span must be one that ends all tokens:
+// a space, a line break or the NUL terminator. This holds for spans of
+// trimmed lines.
+//
+// ps_reset_spans() starts parsing a new list of spans with a parser that was
+// already initialized. Everything allocated in the parser's pool since then is
+// freed, but the pool's first bin and the stacks stay allocated, so a single
+// parser can be reused for the inline content of all blocks of a note.
+void ps_reset_spans (struct psx_parser_state_t *ps, struct sstring_ll_l *spans)
+{
+    mem_pool_end_temporary_memory (ps->pool_start);
+
+    ps->error = false;
+    str_set (&ps->error_msg, "");
+    ps->is_eof = false;
+    ps->is_eol = false;
+    ps->is_peek = false;
+    ps->token = ZERO_INIT (struct psx_token_t);
+    ps->token_peek = ZERO_INIT (struct psx_token_t);
+    ps->block_stack_len = 0;
+    ps->block_unit_stack_len = 0;
+
+    ps->str = "";
+    ps->pos = ps->str;
+    ps->pos_peek = NULL;
+    ps->end = ps->str;
+    ps->span = NULL;
+    ps->block_replacement = NULL;
+    if (spans != NULL) {
+        ps->span = spans;
+        ps->str = spans->v.s;
+        ps->pos = spans->v.s;
+        ps->end = spans->v.s + spans->v.len;
+    }
+}
+
+void ps_init_spans (struct psx_parser_state_t *ps, struct sstring_ll_l *spans)
+{
+    ps_init (ps, "");
+    ps_reset_spans (ps, spans);
 }
 
 void ps_destroy (struct psx_parser_state_t *ps)
@@ -184,17 +349,41 @@ void ps_destroy (struct psx_parser_state_t *ps)
     mem_pool_destroy (&ps->pool);
 }
 
-bool char_in_str (char c, char *str)
-{
-    while (*str != '\0') {
-        if (*str == c) {
-            return true;
-        }
+// Character classes used by the tokenizers, looked up in a table instead of
+// comparing against each character of the class. The end of the string is a
+// class of its own so loops can stop at a class without testing for EOF
+// separately.
+enum psx_char_class_t {
+    PSX_CHAR_OPERATOR = 1<<0,
+    PSX_CHAR_DIGIT    = 1<<1,
+    PSX_CHAR_SPACE    = 1<<2,
+    PSX_CHAR_NEWLINE  = 1<<3,
+    PSX_CHAR_EOF      = 1<<4
+};
 
-        str++;
-    }
+// Characters that end the name of a tag, and those that end a text token.
+#define PSX_CHAR_TAG_END (PSX_CHAR_OPERATOR | PSX_CHAR_SPACE | PSX_CHAR_NEWLINE | PSX_CHAR_EOF)
+#define PSX_CHAR_TEXT_END (PSX_CHAR_OPERATOR | PSX_CHAR_SPACE | PSX_CHAR_NEWLINE | PSX_CHAR_EOF)
+
+static const uint8_t psx_char_classes[256] = {
+    ['\0'] = PSX_CHAR_EOF,
+    [','] = PSX_CHAR_OPERATOR,
+    ['='] = PSX_CHAR_OPERATOR,
+    ['['] = PSX_CHAR_OPERATOR,
+    [']'] = PSX_CHAR_OPERATOR,
+    ['{'] = PSX_CHAR_OPERATOR,
+    ['}'] = PSX_CHAR_OPERATOR,
+    ['\\'] = PSX_CHAR_OPERATOR,
+    ['0' ... '9'] = PSX_CHAR_DIGIT,
+    [' '] = PSX_CHAR_SPACE,
+    ['\t'] = PSX_CHAR_SPACE,
+    ['\n'] = PSX_CHAR_NEWLINE
+};
 
-    return false;
+static inline
+bool char_is_class (char c, uint8_t class_mask)
+{
+    return (psx_char_classes[(uint8_t)c] & class_mask) != 0;
 }
 
 static inline
@@ -203,26 +392,182 @@ char ps_curr_char (struct psx_parser_state_t *ps)
     return *(ps->pos);
 }
 
+static inline
+bool pos_is_class (struct psx_parser_state_t *ps, uint8_t class_mask)
+{
+    return char_is_class (ps_curr_char(ps), class_mask);
+}
+
+static inline
 bool pos_is_eof (struct psx_parser_state_t *ps)
 {
-    return ps_curr_char(ps) == '\0';
+    return ps->pos >= ps->end || ps_curr_char(ps) == '\0';
 }
 
+static inline
 bool pos_is_operator (struct psx_parser_state_t *ps)
 {
-    return !pos_is_eof(ps) && char_in_str(ps_curr_char(ps), ",=[]{}\\");
+    return pos_is_class (ps, PSX_CHAR_OPERATOR);
 }
 
+static inline
 bool pos_is_digit (struct psx_parser_state_t *ps)
 {
-    return !pos_is_eof(ps) && char_in_str(ps_curr_char(ps), "1234567890");
+    return pos_is_class (ps, PSX_CHAR_DIGIT);
 }
 
+static inline
 bool pos_is_space (struct psx_parser_state_t *ps)
 {
-    return !pos_is_eof(ps) && is_space(ps->pos);
+    return pos_is_class (ps, PSX_CHAR_SPACE);
+}
+
+// Advances while the current character is not in any of the classes in
+// class_mask. These loops never reach the end of the string, unless
+// PSX_CHAR_EOF is in class_mask, the caller must make sure of it.
+static inline
+void ps_advance_until_class (struct psx_parser_state_t *ps, uint8_t class_mask)
+{
+    while (!pos_is_class (ps, class_mask)) {
+        ps->pos++;
+    }
 }
 
+// Advances while the current character is in one of the classes in
+// class_mask. PSX_CHAR_EOF must not be in class_mask.
+static inline
+void ps_advance_while_class (struct psx_parser_state_t *ps, uint8_t class_mask)
+{
+    while (pos_is_class (ps, class_mask)) {
+        ps->pos++;
+    }
+}
+
+// Moves to the start of the next non empty span, returns false if there are
+// no more spans.
+bool ps_next_span (struct psx_parser_state_t *ps)
+{
+    while (ps->span != NULL && ps->span->next != NULL) {
+        ps->span = ps->span->next;
+        ps->pos = ps->span->v.s;
+        ps->end = ps->span->v.s + ps->span->v.len;
+
+        if (ps->pos < ps->end) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Vectorized versions of ps_advance_until_class() and
+// ps_advance_while_class() for the scans that usually cover many bytes:
+// finding the end of a line, skipping spaces and finding the end of a text
+// token. They classify 16 bytes at a time with SSE2, or 32 with AVX2 when
+// the CPU supports it, which is checked at runtime.
+//
+// Scanners stop at end, which they never read past. Chunks are only loaded
+// while they fit before end, the rest is scanned one byte at a time, so
+// buffers don't need any padding.
+#if defined(__SSE2__)
+
+#define PSX_CHAR_CLASS_MASK_SIMD(W,chunk,class_mask)                                           \
+({                                                                                             \
+    __m##W##i _found = _mm##W##_setzero_si##W ();                                              \
+    if ((class_mask) & PSX_CHAR_EOF) {                                                         \
+        _found = _mm##W##_or_si##W (_found, _mm##W##_cmpeq_epi8 (chunk, _mm##W##_setzero_si##W ())); \
+    }                                                                                          \
+    if ((class_mask) & PSX_CHAR_NEWLINE) {                                                     \
+        _found = _mm##W##_or_si##W (_found, _mm##W##_cmpeq_epi8 (chunk, _mm##W##_set1_epi8 ('\n'))); \
+    }                                                                                          \
+    if ((class_mask) & PSX_CHAR_SPACE) {                                                       \
+        _found = _mm##W##_or_si##W (_found, _mm##W##_cmpeq_epi8 (chunk, _mm##W##_set1_epi8 (' '))); \
+        _found = _mm##W##_or_si##W (_found, _mm##W##_cmpeq_epi8 (chunk, _mm##W##_set1_epi8 ('\t'))); \
+    }                                                                                          \
+    if ((class_mask) & PSX_CHAR_OPERATOR) {                                                    \
+        const char *_op = ",=[]{}\\";                                                          \
+        for (int _i=0; _op[_i] != '\0'; _i++) {                                                \
+            _found = _mm##W##_or_si##W (_found, _mm##W##_cmpeq_epi8 (chunk, _mm##W##_set1_epi8 (_op[_i]))); \
+        }                                                                                      \
+    }                                                                                          \
+    (uint32_t)_mm##W##_movemask_epi8 (_found);                                                 \
+})
+
+// _mm_ functions don't have a width in their name.
+#define _mm128i __m128i
+#define _mm128_setzero_si128 _mm_setzero_si128
+#define _mm128_or_si128 _mm_or_si128
+#define _mm128_cmpeq_epi8 _mm_cmpeq_epi8
+#define _mm128_set1_epi8 _mm_set1_epi8
+#define _mm128_movemask_epi8 _mm_movemask_epi8
+#define __m128i_load(p) _mm_loadu_si128 ((const __m128i*)(p))
+#define __m256i_load(p) _mm256_loadu_si256 ((const __m256i*)(p))
+
+// Defines NAME(), which returns the first position in [s, end) whose
+// character is in CLASS_MASK, or if IS_WHILE, the first one that isn't. If
+// there's none it returns end. The first SCALAR_LEN characters are checked
+// one by one, for scans that usually end after a few bytes this is faster
+// than setting up a vector compare.
+#define PSX_SCANNER_NEW(NAME,CLASS_MASK,IS_WHILE,SCALAR_LEN)                                   \
+static inline                                                                                  \
+char* NAME ## _scalar (char *s, char *end)                                                     \
+{                                                                                              \
+    while (s < end && char_is_class (*s, CLASS_MASK) == (IS_WHILE)) s++;                       \
+    return s;                                                                                  \
+}                                                                                              \
+                                                                                               \
+static inline                                                                                  \
+char* NAME ## _sse2 (char *s, char *end)                                                       \
+{                                                                                              \
+    for (; end - s >= 16; s += 16) {                                                           \
+        uint32_t mask = PSX_CHAR_CLASS_MASK_SIMD(128, __m128i_load (s), CLASS_MASK);           \
+        if (IS_WHILE) mask = ~mask & 0xFFFF;                                                   \
+        if (mask != 0) return s + __builtin_ctz (mask);                                        \
+    }                                                                                          \
+    return NAME ## _scalar (s, end);                                                           \
+}                                                                                              \
+                                                                                               \
+__attribute__((target("avx2")))                                                                \
+char* NAME ## _avx2 (char *s, char *end)                                                       \
+{                                                                                              \
+    for (; end - s >= 32; s += 32) {                                                           \
+        uint32_t mask = PSX_CHAR_CLASS_MASK_SIMD(256, __m256i_load (s), CLASS_MASK);           \
+        if (IS_WHILE) mask = ~mask;                                                            \
+        if (mask != 0) return s + __builtin_ctz (mask);                                        \
+    }                                                                                          \
+    return NAME ## _sse2 (s, end);                                                             \
+}                                                                                              \
+                                                                                               \
+static inline                                                                                  \
+char* NAME (char *s, char *end)                                                                \
+{                                                                                              \
+    for (int i=0; i<(SCALAR_LEN); i++, s++) {                                                  \
+        if (s == end || char_is_class (*s, CLASS_MASK) != (IS_WHILE)) return s;                \
+    }                                                                                          \
+                                                                                               \
+    if (__builtin_cpu_supports ("avx2")) {                                                     \
+        return NAME ## _avx2 (s, end);                                                         \
+    } else {                                                                                   \
+        return NAME ## _sse2 (s, end);                                                         \
+    }                                                                                          \
+}
+
+#else
+
+#define PSX_SCANNER_NEW(NAME,CLASS_MASK,IS_WHILE,SCALAR_LEN)                                   \
+static inline                                                                                  \
+char* NAME (char *s, char *end)                                                                \
+{                                                                                              \
+    while (s < end && char_is_class (*s, CLASS_MASK) == (IS_WHILE)) s++;                       \
+    return s;                                                                                  \
+}
+
+#endif
+
+PSX_SCANNER_NEW (psx_scan_line_end, PSX_CHAR_NEWLINE | PSX_CHAR_EOF, false, 0)
+PSX_SCANNER_NEW (psx_scan_text_end, PSX_CHAR_TEXT_END, false, 16)
+PSX_SCANNER_NEW (psx_skip_spaces, PSX_CHAR_SPACE, true, 4)
+
 bool is_empty_line (sstring_t line)
 {
     int count = 0;
@@ -271,9 +616,7 @@ bool ps_match_digits (struct psx_parser_state_t *ps)
     bool found = false;
     if (pos_is_digit(ps)) {
         found = true;
-        while (pos_is_digit(ps)) {
-            ps_advance_char (ps);
-        }
+        ps_advance_while_class (ps, PSX_CHAR_DIGIT);
     }
     return found;
 }
@@ -281,17 +624,13 @@ bool ps_match_digits (struct psx_parser_state_t *ps)
 static inline
 void ps_consume_spaces (struct psx_parser_state_t *ps)
 {
-    while (pos_is_space(ps)) {
-        ps_advance_char (ps);
-    }
+    ps->pos = psx_skip_spaces (ps->pos, ps->end);
 }
 
 sstring_t advance_line(struct psx_parser_state_t *ps)
 {
     char *start = ps->pos;
-    while (!pos_is_eof(ps) && ps_curr_char(ps) != '\n') {
-        ps_advance_char (ps);
-    }
+    ps->pos = psx_scan_line_end (ps->pos, ps->end);
 
     // Advance over the \n character. We leave \n characters because they are
     // handled by the inline parser. Sometimes they are ignored (between URLs),
@@ -301,18 +640,13 @@ sstring_t advance_line(struct psx_parser_state_t *ps)
     return SSTRING(start, ps->pos - start);
 }
 
-BINARY_TREE_NEW (sstring_map, sstring_t, sstring_t, strncmp(a.s, b.s, MIN(a.len, b.len)))
-
-struct sstring_ll_l {
-    sstring_t v;
-    struct sstring_ll_l *next;
-};
+HASH_MAP_NEW (sstring, sstring_t, sstring_t, fnv1a_64(key.s, key.len), a.len == b.len && strncmp(a.s, b.s, a.len) == 0, key)
 
 struct psx_tag_parameters_t {
     struct sstring_ll_l *positional;
     struct sstring_ll_l *positional_end;
 
-    struct sstring_map_tree_t named;
+    struct sstring_map_t named;
 };
 
 void ps_parse_tag_parameters (struct psx_parser_state_t *ps, struct psx_tag_parameters_t *parameters)
@@ -331,7 +665,8 @@ void ps_parse_tag_parameters (struct psx_parser_state_t *ps, struct psx_tag_para
                 // values containing "," or "]".
             }
 
-            while (ps_curr_char(ps) != ',' &&
+            while (!ps->is_eof &&
+                   ps_curr_char(ps) != ',' &&
                    ps_curr_char(ps) != '=' &&
                    ps_curr_char(ps) != ']') {
                 ps_advance_char (ps);
@@ -350,7 +685,8 @@ void ps_parse_tag_parameters (struct psx_parser_state_t *ps, struct psx_tag_para
                 ps_advance_char (ps);
 
                 char *value_start = ps->pos;
-                while (ps_curr_char(ps) != ',' &&
+                while (!ps->is_eof &&
+                       ps_curr_char(ps) != ',' &&
                        ps_curr_char(ps) != ']') {
                     ps_advance_char (ps);
                 }
@@ -358,7 +694,7 @@ void ps_parse_tag_parameters (struct psx_parser_state_t *ps, struct psx_tag_para
                 sstring_t value = sstr_trim(SSTRING(value_start, ps->pos - value_start));
 
                 if (parameters != NULL) {
-                    sstring_map_tree_insert (&parameters->named, name, value);
+                    sstring_map_insert (&parameters->named, name, value);
                 }
             }
 
@@ -424,6 +760,10 @@ struct psx_token_t ps_next_peek(struct psx_parser_state_t *ps)
             tok->margin = non_space_pos - backup_pos;
             tok->type = TOKEN_TYPE_TITLE;
             tok->heading_number = heading_number;
+
+        } else {
+            // It wasn't a heading, restore position.
+            ps->pos = backup_pos;
         }
 
     } else if (ps_match_str(ps, "\\code")) {
@@ -431,9 +771,7 @@ struct psx_token_t ps_next_peek(struct psx_parser_state_t *ps)
 
         if (!ps_match_str(ps, "{")) {
             tok->type = TOKEN_TYPE_CODE_HEADER;
-            while (pos_is_space(ps) || ps_curr_char(ps) == '\n') {
-                ps_advance_char (ps);
-            }
+            ps_advance_while_class (ps, PSX_CHAR_SPACE | PSX_CHAR_NEWLINE);
 
         } else {
             // False alarm, this was an inline code block, restore position.
@@ -502,7 +840,7 @@ struct psx_token_t ps_inline_next(struct psx_parser_state_t *ps)
 {
     struct psx_token_t tok = {0};
 
-    if (pos_is_eof(ps)) {
+    if (pos_is_eof(ps) && !ps_next_span(ps)) {
         ps->is_eof = true;
 
     } else if (ps_curr_char(ps) == '\\') {
@@ -510,9 +848,7 @@ struct psx_token_t ps_inline_next(struct psx_parser_state_t *ps)
         ps_advance_char (ps);
 
         char *start = ps->pos;
-        while (!pos_is_eof(ps) && !pos_is_operator(ps) && !pos_is_space(ps)) {
-            ps_advance_char (ps);
-        }
+        ps_advance_until_class (ps, PSX_CHAR_TAG_END);
         tok.value = SSTRING(start, ps->pos - start);
         tok.type = TOKEN_TYPE_TAG;
 
@@ -521,26 +857,22 @@ struct psx_token_t ps_inline_next(struct psx_parser_state_t *ps)
         tok.value = SSTRING(ps->pos, 1);
         ps_advance_char (ps);
 
-    } else if (pos_is_space(ps) || ps_curr_char(ps) == '\n') {
+    } else if (pos_is_class(ps, PSX_CHAR_SPACE | PSX_CHAR_NEWLINE)) {
         // This consumes consecutive spaces into a single one.
-        while (pos_is_space(ps) || ps_curr_char(ps) == '\n') {
-            ps_advance_char (ps);
-        }
+        ps_advance_while_class (ps, PSX_CHAR_SPACE | PSX_CHAR_NEWLINE);
 
         tok.value = SSTRING(" ", 1);
         tok.type = TOKEN_TYPE_SPACE;
 
     } else {
         char *start = ps->pos;
-        while (!pos_is_eof(ps) && !pos_is_operator(ps) && !pos_is_space(ps) && ps_curr_char(ps) != '\n') {
-            ps_advance_char (ps);
-        }
+        ps->pos = psx_scan_text_end (ps->pos, ps->end);
 
         tok.value = SSTRING(start, ps->pos - start);
         tok.type = TOKEN_TYPE_TEXT;
     }
 
-    if (pos_is_eof(ps)) {
+    if (pos_is_eof(ps) && !ps_next_span(ps)) {
         ps->is_eof = true;
     }
 
@@ -586,7 +918,6 @@ struct psx_tag_t ps_parse_tag (struct psx_parser_state_t *ps)
 {
     struct psx_tag_parameters_t parameters = {0};
     string_t content = {0};
-    str_pool (&ps->pool, &content);
 
     ps_parse_tag_parameters(ps, &parameters);
 
@@ -601,29 +932,14 @@ struct psx_tag_t ps_parse_tag (struct psx_parser_state_t *ps)
     if (!ps->error) {
         tag.parameters = parameters;
         tag.content = content;
+
+    } else {
+        str_free (&content);
     }
 
     return tag;
 }
 
-//function ps_parse_tag_balanced_braces (ps)
-//{
-//    let tag = {
-//        attributes: null,
-//        content: null,
-//    };
-//
-//    let attributes = ps_parse_tag_parameters(ps);
-//    let content = html_escape(parse_balanced_brace_block(ps));
-//
-//    if (!ps.error) {
-//        tag.attributes = attributes;
-//        tag.content = content;
-//    }
-//
-//    return tag;
-//}
-
 enum psx_block_unit_type_t {
     BLOCK_UNIT_TYPE_ROOT,
     BLOCK_UNIT_TYPE_HTML
@@ -683,11 +999,6 @@ void str_cat_literal_token (string_t *str, struct psx_parser_state_t *ps)
     strn_cat_c (str, ps->token.value.s, ps->token.value.len);
 }
 
-//function html_escape (str)
-//{
-//    return str.replaceAll("<", "&lt;").replaceAll(">", "&gt;")
-//}
-
 void parse_balanced_brace_block(struct psx_parser_state_t *ps, string_t *str)
 {
     assert (str != NULL);
@@ -711,6 +1022,28 @@ void parse_balanced_brace_block(struct psx_parser_state_t *ps, string_t *str)
     }
 }
 
+// Like ps_parse_tag() but the content can contain balanced braces, and tags
+// inside of it are kept as literal text.
+struct psx_tag_t ps_parse_tag_balanced_braces (struct psx_parser_state_t *ps)
+{
+    struct psx_tag_parameters_t parameters = {0};
+    string_t content = {0};
+
+    ps_parse_tag_parameters(ps, &parameters);
+    parse_balanced_brace_block(ps, &content);
+
+    struct psx_tag_t tag = {0};
+    if (!ps->error) {
+        tag.parameters = parameters;
+        tag.content = content;
+
+    } else {
+        str_free (&content);
+    }
+
+    return tag;
+}
+
 void compute_media_size (struct psx_tag_parameters_t *parameters, double aspect_ratio, double max_width, double *w, double *h)
 {
     assert (w != NULL && h != NULL);
@@ -752,22 +1085,513 @@ void compute_media_size (struct psx_tag_parameters_t *parameters, double aspect_
     *h = height;
 }
 
+void psx_note_links_add (struct psx_note_links_t *note_links, char *target, size_t len, bool is_summary)
+{
+    if (note_links == NULL) return;
+
+    LINKED_LIST_APPEND_NEW (note_links->pool, struct psx_link_t, note_links->links, new_link);
+    new_link->target = pom_strndup (note_links->pool, target, len);
+    new_link->is_summary = is_summary;
+    note_links->num_links++;
+}
+
+// Compiled regular expressions are cached for the lifetime of the process,
+// keyed by pattern and flags. Compiled programs aren't modified by regexec(),
+// so the same program can be used by multiple threads at the same time, the
+// lock only protects the cache itself.
+struct psx_regex_key_t {
+    char *pattern;
+    int flags;
+};
+
+HASH_MAP_NEW (psx_regex, struct psx_regex_key_t, Reprog*,
+              fnv1a_64_str(key.pattern) ^ key.flags,
+              a.flags == b.flags && strcmp(a.pattern, b.pattern) == 0,
+              ((struct psx_regex_key_t){pom_strdup(pool, key.pattern), key.flags}))
+
+struct psx_regex_map_t psx_regex_cache = {0};
+pthread_mutex_t psx_regex_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns NULL if pattern fails to compile, the error is returned in error if
+// it's not NULL. Returned programs must not be freed.
+Reprog* regcomp_cached (char *pattern, int flags, const char **error)
+{
+    struct psx_regex_key_t key = {pattern, flags};
+    Reprog *regex = NULL;
+
+    pthread_mutex_lock (&psx_regex_cache_lock);
+    if (!psx_regex_map_maybe_get (&psx_regex_cache, key, &regex)) {
+        const char *compile_error = NULL;
+        regex = regcomp (pattern, flags, &compile_error);
+        if (regex != NULL) {
+            psx_regex_map_insert (&psx_regex_cache, key, regex);
+        } else if (error != NULL) {
+            *error = compile_error;
+        }
+    }
+    pthread_mutex_unlock (&psx_regex_cache_lock);
+
+    return regex;
+}
+
+void regcomp_cache_destroy ()
+{
+    pthread_mutex_lock (&psx_regex_cache_lock);
+    HASH_MAP_FOR (psx_regex, &psx_regex_cache, entry) {
+        regfree (entry->value);
+    }
+    psx_regex_map_destroy (&psx_regex_cache);
+    psx_regex_cache = ZERO_INIT (struct psx_regex_map_t);
+    pthread_mutex_unlock (&psx_regex_cache_lock);
+}
+
+#define PSX_YOUTUBE_REGEX "^.*(youtu.be\\/|youtube(-nocookie)?.com\\/(v\\/|.*u\\/\\w\\/|embed\\/|.*v=))([\\w-]{11}).*"
+
+PSX_TAG_CB (psx_tag_style)
+{
+    struct psx_token_t tag = ps->token;
+    ps_expect_inline (ps, TOKEN_TYPE_OPERATOR, "{");
+    psx_push_block_unit_new (ps, html, tag.value);
+}
+
+PSX_TAG_CB (psx_tag_link)
+{
+    string_t buff = {0};
+    struct psx_tag_t tag = ps_parse_tag (ps);
+
+    // We parse the URL from the title starting at the end. I thinkg is
+    // far less likely to have a non URL encoded > character in the
+    // URL, than a user wanting to use > inside their title.
+    //
+    // TODO: Support another syntax for the rare case of a user that
+    // wants a > character in a URL. Or make sure URLs are URL encoded
+    // from the UI that will be used to edit this.
+    ssize_t pos = (ssize_t)str_len(&tag.content) - 1;
+    while (pos > 0 && str_data(&tag.content)[pos] != '>') {
+        pos--;
+    }
+
+    sstring_t url = SSTRING(str_data(&tag.content), str_len(&tag.content));
+    sstring_t title = SSTRING(str_data(&tag.content), str_len(&tag.content));
+    if (pos > 0 && str_data(&tag.content)[pos - 1] == '-') {
+        pos--;
+        url = sstr_trim(SSTRING(str_data(&tag.content) + pos + 2, str_len(&tag.content) - (pos + 2)));
+        title = sstr_trim(SSTRING(str_data(&tag.content), pos));
+
+        // TODO: It would be nice to heve this API...
+        //sstr_trim(sstr_substr(pos+2));
+        //sstr_trim(sstr_substr(0, pos));
+    }
+
+    struct html_element_t *link_element = html_new_element (html, "a");
+    strn_set (&buff, url.s, url.len);
+    html_element_attribute_set (html, link_element, "href", str_data(&buff));
+    html_element_attribute_set (html, link_element, "target", "_blank");
+    html_element_append_strn (html, link_element, title.len, title.s);
+
+    html_element_append_child (html, container, link_element);
+    psx_tag_destroy (&tag);
+    str_free (&buff);
+}
+
+PSX_TAG_CB (psx_tag_youtube)
+{
+    string_t buff = {0};
+    struct psx_tag_t tag = ps_parse_tag (ps);
+
+    sstring_t video_id = {0};
+    const char *error;
+    Resub m;
+    Reprog *regex = regcomp_cached (PSX_YOUTUBE_REGEX, REG_LINEAR, &error);
+    if (regex != NULL && !regexec(regex, str_data(&tag.content), &m, 0)) {
+        video_id = SSTRING((char*) m.sub[4].sp, m.sub[4].ep - m.sub[4].sp);
+    }
+
+    //// Assume 16:9 aspect ratio
+    double width, height;
+    compute_media_size(&tag.parameters, 16.0L/9, psx_content_width - 30, &width, &height);
+
+    struct html_element_t *html_element = html_new_element (html, "iframe");
+    str_set_printf (&buff, "%.6g", width);
+    html_element_attribute_set (html, html_element, "width", str_data(&buff));
+    str_set_printf (&buff, "%.6g", height);
+    html_element_attribute_set (html, html_element, "height", str_data(&buff));
+    html_element_attribute_set (html, html_element, "style", "margin: 0 auto; display: block;");
+    str_set_printf (&buff, "https://www.youtube-nocookie.com/embed/%.*s", video_id.len, video_id.s);
+    html_element_attribute_set (html, html_element, "src", str_data(&buff));
+    html_element_attribute_set (html, html_element, "frameborder", "0");
+    html_element_attribute_set (html, html_element, "allow", "accelerometer; autoplay; clipboard-write; encrypted-media; gyroscope; picture-in-picture");
+    html_element_attribute_set (html, html_element, "allowfullscreen", "");
+    html_element_append_child (html, container, html_element);
+    psx_tag_destroy (&tag);
+    str_free (&buff);
+}
+
+PSX_TAG_CB (psx_tag_image)
+{
+    string_t buff = {0};
+    struct psx_tag_t tag = ps_parse_tag (ps);
+
+    struct html_element_t *img_element = html_new_element (html, "img");
+    str_set_printf (&buff, "files/%s", str_data(&tag.content));
+    html_element_attribute_set (html, img_element, "src", str_data(&buff));
+    str_set_printf (&buff, "%d", psx_content_width);
+    html_element_attribute_set (html, img_element, "width", str_data(&buff));
+    html_element_append_child (html, container, img_element);
+    psx_tag_destroy (&tag);
+    str_free (&buff);
+}
+
+PSX_TAG_CB (psx_tag_code)
+{
+    ps_parse_tag_parameters(ps, NULL);
+    // TODO: Actually do something with the passed language name
+
+    string_t code_content = {0};
+    parse_balanced_brace_block(ps, &code_content);
+    if (str_len(&code_content) > 0) {
+        struct html_element_t *code_element = html_new_element (html, "code");
+        html_element_class_add(html, code_element, "code-inline");
+        html_element_append_strn (html, code_element, str_len(&code_content), str_data(&code_content));
+
+        html_element_append_child (html, container, code_element);
+    }
+    str_free (&code_content);
+}
+
+void psx_append_note_link (struct html_t *html, struct html_element_t *container, string_t *title)
+{
+    string_t buff = {0};
+
+    struct html_element_t *link_element = html_new_element (html, "a");
+    str_set_printf (&buff, "return open_note_by_title('%.*s');", str_len(title), str_data(title));
+    html_element_attribute_set (html, link_element, "onclick", str_data(&buff));
+    html_element_attribute_set (html, link_element, "href", "#");
+    html_element_class_add (html, link_element, "note-link");
+    html_element_append_strn (html, link_element, str_len(title), str_data(title));
+
+    html_element_append_child (html, container, link_element);
+    str_free (&buff);
+}
+
+// Links in blocks that replaced others belong to other notes, they aren't
+// collected. Neither are links of tags that failed to parse, their content
+// isn't a title.
+PSX_TAG_CB (psx_tag_note)
+{
+    struct psx_tag_t tag = ps_parse_tag (ps);
+    if (!ps->error && !ps->in_replacement) {
+        psx_note_links_add (ps->note_links, str_data(&tag.content), str_len(&tag.content), false);
+    }
+    psx_append_note_link (html, container, &tag.content);
+    psx_tag_destroy (&tag);
+}
+
+// Replaces the block containing the tag being parsed with the children of
+// root, the rest of the block's content is ignored. Blocks in root must stay
+// allocated until the note is rendered, allocating them in html->pool works.
+//
+// Returns false if the block can't be replaced because it's part of another
+// replacement, this avoids infinite recursion when tags include each other's
+// content. Then the tag should render something inline instead.
+bool psx_block_replace (struct psx_parser_state_t *ps, struct psx_block_t *root)
+{
+    if (ps->in_replacement || ps->block_replacement != NULL) return false;
+
+    ps->block_replacement = root;
+    return true;
+}
+
+struct psx_block_t* parse_note_text(mem_pool_t *pool, char *note_text);
+
+// The summary of a note is its title as a level 2 heading linking to it,
+// followed by its first paragraph if the note starts with one.
+struct psx_block_t* psx_summary_blocks (mem_pool_t *pool, char *markup)
+{
+    struct psx_block_t *root = parse_note_text (pool, markup);
+
+    struct psx_block_t *heading = root->block_content;
+    if (heading == NULL || heading->type != BLOCK_TYPE_HEADING) return NULL;
+
+    string_t title = {0};
+    str_cat_sstring_list (&title, heading->inline_content);
+    char *link = pprintf (pool, "\\note{%s}", str_data(&title));
+    str_free (&title);
+
+    heading->heading_number = 2;
+    heading->inline_content = NULL;
+    heading->inline_content_end = NULL;
+    LINKED_LIST_APPEND_NEW (pool, struct sstring_ll_l, heading->inline_content, span);
+    span->v = SSTRING_C(link);
+
+    struct psx_block_t *paragraph = heading->next;
+    if (paragraph != NULL && paragraph->type == BLOCK_TYPE_PARAGRAPH) {
+        paragraph->next = NULL;
+        root->block_content_end = paragraph;
+
+    } else {
+        heading->next = NULL;
+        root->block_content_end = heading;
+    }
+
+    return root;
+}
+
+// Replaces the block containing the tag with the summary of the target note,
+// if user_data is a psx_note_source_t that has it. Otherwise it's rendered
+// as a note link.
+PSX_TAG_CB (psx_tag_summary)
+{
+    struct psx_note_source_t *source = (struct psx_note_source_t*)user_data;
+    struct psx_tag_t tag = ps_parse_tag (ps);
+    if (!ps->error && !ps->in_replacement) {
+        psx_note_links_add (ps->note_links, str_data(&tag.content), str_len(&tag.content), true);
+    }
+
+    struct psx_block_t *summary = NULL;
+    if (source != NULL && !ps->error && !ps->in_replacement) {
+        char *markup = source->get_note (html->pool, str_data(&tag.content), source->data);
+        if (markup != NULL) {
+            summary = psx_summary_blocks (html->pool, markup);
+        }
+    }
+
+    if (summary == NULL || !psx_block_replace (ps, summary)) {
+        psx_append_note_link (html, container, &tag.content);
+    }
+    psx_tag_destroy (&tag);
+}
+
+// If user_data is a psx_math_source_t that has the HTML of the math, it's
+// appended as is. Otherwise the TeX is kept as the text of an element with
+// class math, so at least it's readable, and it's counted as missing so the
+// note can be rendered again once the HTML is available. Display mode math,
+// from \Math, also has the class display.
+void psx_append_math (struct psx_parser_state_t *ps, struct html_t *html, struct html_element_t *container,
+                      struct psx_math_source_t *source, bool display_mode)
+{
+    struct psx_tag_t tag = ps_parse_tag_balanced_braces (ps);
+
+    if (ps->note_links != NULL) {
+        ps->note_links->num_math++;
+    }
+
+    char *math_html = NULL;
+    if (source != NULL && !ps->error) {
+        math_html = source->get_math (str_data(&tag.content), display_mode, source->data);
+    }
+
+    if (math_html != NULL) {
+        html_element_append_raw_strn (html, container, strlen(math_html), math_html);
+
+    } else {
+        if (source != NULL && ps->note_links != NULL) {
+            ps->note_links->num_missing_math++;
+        }
+
+        // Set the class directly, html_element_class_add() separates classes
+        // with commas.
+        struct html_element_t *math_element = html_new_element (html, "span");
+        html_element_attribute_set (html, math_element, "class", display_mode ? "math display" : "math");
+        if (str_len(&tag.content) > 0) {
+            html_element_append_strn (html, math_element, str_len(&tag.content), str_data(&tag.content));
+        }
+
+        html_element_append_child (html, container, math_element);
+    }
+
+    psx_tag_destroy (&tag);
+}
+
+PSX_TAG_CB (psx_tag_math)
+{
+    psx_append_math (ps, html, container, (struct psx_math_source_t*)user_data, false);
+}
+
+// TODO: Is this a good way to implement display style?. I think capitalizing
+// the starting M is easier to memorize than adding an attribute with a name
+// that has to be remembered, is it display, displayMode, displat-mode=true?.
+PSX_TAG_CB (psx_tag_math_display)
+{
+    psx_append_math (ps, html, container, (struct psx_math_source_t*)user_data, true);
+}
+
+PSX_TAG_CB (psx_tag_html)
+{
+    // TODO: How can we support '}' characters here?. I don't think
+    // assuming there will be balanced braces is an option here, as it
+    // is in the \code tag. We most likely will need to implement user
+    // defined termintating strings.
+    struct psx_tag_t tag = ps_parse_tag (ps);
+    html_element_append_raw_strn (html, container, str_len(&tag.content), str_data(&tag.content));
+    psx_tag_destroy (&tag);
+}
+
+#define PSX_TAGS_TABLE                            \
+    PSX_TAGS_ROW("i",       psx_tag_style)        \
+    PSX_TAGS_ROW("b",       psx_tag_style)        \
+    PSX_TAGS_ROW("link",    psx_tag_link)         \
+    PSX_TAGS_ROW("youtube", psx_tag_youtube)      \
+    PSX_TAGS_ROW("image",   psx_tag_image)        \
+    PSX_TAGS_ROW("code",    psx_tag_code)         \
+    PSX_TAGS_ROW("note",    psx_tag_note)         \
+    PSX_TAGS_ROW("summary", psx_tag_summary)      \
+    PSX_TAGS_ROW("math",    psx_tag_math)         \
+    PSX_TAGS_ROW("Math",    psx_tag_math_display) \
+    PSX_TAGS_ROW("html",    psx_tag_html)
+
+// Registry of tag callbacks, it contains the tags in PSX_TAGS_TABLE and the
+// ones registered with psx_tag_register(). Tags are looked up in a perfect
+// hash table, every tag has a slot of its own so a lookup hashes the name
+// once and compares against a single tag. C can't hash string literals in a
+// constant expression, so the table is built from PSX_TAGS_TABLE the first
+// time a tag is looked up, trying seeds for the hash until there are no
+// collisions. Registering a tag builds it again.
+#define PSX_MAX_TAGS 64
+#define PSX_TAGS_MAX_TABLE_SIZE 1024
+
+struct psx_tag_handler_t {
+    sstring_t name;
+    psx_tag_cb_t *cb;
+    void *user_data;
+};
+
+struct psx_tag_registry_t {
+    int num_tags;
+    struct psx_tag_handler_t tags[PSX_MAX_TAGS];
+
+    uint64_t seed;
+    uint32_t mask;
+    // Index into tags plus one, 0 means empty.
+    uint8_t table[PSX_TAGS_MAX_TABLE_SIZE];
+};
+
+struct psx_tag_registry_t psx_tags = {0};
+pthread_once_t psx_tags_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t psx_tags_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline
+uint32_t psx_tag_hash (uint64_t seed, sstring_t name)
+{
+    return (uint32_t)fnv1a_64_update (FNV1A_64_OFFSET_BASIS ^ seed, name.s, name.len);
+}
+
+bool psx_tags_build (struct psx_tag_registry_t *registry)
+{
+    uint32_t size = 1;
+    while (size < 2*registry->num_tags) size *= 2;
+
+    for (; size <= PSX_TAGS_MAX_TABLE_SIZE; size *= 2) {
+        for (uint64_t seed = 0; seed < 256; seed++) {
+            memset (registry->table, 0, size);
+
+            int i;
+            for (i=0; i<registry->num_tags; i++) {
+                uint32_t slot = psx_tag_hash (seed, registry->tags[i].name) & (size - 1);
+                if (registry->table[slot] != 0) break;
+                registry->table[slot] = i + 1;
+            }
+
+            if (i == registry->num_tags) {
+                registry->seed = seed;
+                registry->mask = size - 1;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void psx_tags_add (struct psx_tag_registry_t *registry, char *name, psx_tag_cb_t *cb, void *user_data)
+{
+    sstring_t name_str = SSTRING_C(name);
+
+    struct psx_tag_handler_t *handler = NULL;
+    for (int i=0; i<registry->num_tags; i++) {
+        if (sstr_equals (registry->tags[i].name, name_str)) {
+            handler = &registry->tags[i];
+            break;
+        }
+    }
+
+    if (handler == NULL) {
+        assert (registry->num_tags < PSX_MAX_TAGS);
+        handler = &registry->tags[registry->num_tags++];
+    }
+
+    handler->name = name_str;
+    handler->cb = cb;
+    handler->user_data = user_data;
+}
+
+void psx_tags_init ()
+{
+#define PSX_TAGS_ROW(name,cb) psx_tags_add (&psx_tags, name, cb, NULL);
+    PSX_TAGS_TABLE
+#undef PSX_TAGS_ROW
+
+    psx_tags_build (&psx_tags);
+}
+
+// Registers cb as the callback for tags called name, replacing any previous
+// callback for it, including the built in ones. The name isn't copied, it
+// must stay valid while tags are being rendered. Tags can't be registered
+// while other threads are rendering notes.
+bool psx_tag_register (char *name, psx_tag_cb_t *cb, void *user_data)
+{
+    bool success = true;
+
+    pthread_once (&psx_tags_once, psx_tags_init);
+
+    pthread_mutex_lock (&psx_tags_lock);
+    struct psx_tag_registry_t registry = psx_tags;
+    if (registry.num_tags < PSX_MAX_TAGS) {
+        psx_tags_add (&registry, name, cb, user_data);
+        success = psx_tags_build (&registry);
+    } else {
+        success = false;
+    }
+
+    if (success) {
+        psx_tags = registry;
+    }
+    pthread_mutex_unlock (&psx_tags_lock);
+
+    return success;
+}
+
+struct psx_tag_handler_t* psx_tag_lookup (sstring_t name)
+{
+    pthread_once (&psx_tags_once, psx_tags_init);
+
+    uint8_t idx = psx_tags.table[psx_tag_hash (psx_tags.seed, name) & psx_tags.mask];
+    if (idx != 0 && sstr_equals (psx_tags.tags[idx-1].name, name)) {
+        return &psx_tags.tags[idx-1];
+    }
+
+    return NULL;
+}
+
 // This function parses the content of a block of text. The formatting is
 // limited to tags that affect the formating inline. This parsing function
 // will not add nested blocks like paragraphs, lists, code blocks etc.
 //
 // TODO: How do we handle the prescence of nested blocks here?, ignore them and
 // print them or raise an error and stop parsing.
-void block_content_parse_text (struct html_t *html, struct html_element_t *container, char *content)
+//
+// The parser state ps is reset to parse content, it must have been
+// initialized with ps_init_spans().
+void block_content_parse_text (struct psx_parser_state_t *ps, struct html_t *html, struct html_element_t *container,
+                               struct sstring_ll_l *content, struct psx_note_links_t *note_links)
 {
-    string_t buff = {0};
-    struct psx_parser_state_t _ps = {0};
-    struct psx_parser_state_t *ps = &_ps;
-    ps_init (ps, content);
+    ps_reset_spans (ps, content);
+    ps->note_links = note_links;
 
     DYNAMIC_ARRAY_APPEND (ps->block_unit_stack, psx_block_unit_new (&ps->pool, BLOCK_UNIT_TYPE_ROOT, container));
-    while (!ps->is_eof && !ps->error) {
+    while (!ps->is_eof && !ps->error && ps->block_replacement == NULL) {
         struct psx_token_t tok = ps_inline_next (ps);
+        struct psx_tag_handler_t *handler;
 
         if (ps_match(ps, TOKEN_TYPE_TEXT, NULL) || ps_match(ps, TOKEN_TYPE_SPACE, NULL)) {
             struct psx_block_unit_t *curr_unit = DYNAMIC_ARRAY_GET_LAST(ps->block_unit_stack);
@@ -776,125 +1600,9 @@ void block_content_parse_text (struct html_t *html, struct html_element_t *conta
         } else if (ps_match(ps, TOKEN_TYPE_OPERATOR, "}") && DYNAMIC_ARRAY_GET_LAST(ps->block_unit_stack)->type != BLOCK_UNIT_TYPE_ROOT) {
             psx_block_unit_pop (ps);
 
-        } else if (ps_match(ps, TOKEN_TYPE_TAG, "i") || ps_match(ps, TOKEN_TYPE_TAG, "b")) {
-            struct psx_token_t tag = ps->token;
-            ps_expect_inline (ps, TOKEN_TYPE_OPERATOR, "{");
-            psx_push_block_unit_new (ps, html, tag.value);
-
-        } else if (ps_match(ps, TOKEN_TYPE_TAG, "link")) {
-             struct psx_tag_t tag = ps_parse_tag (ps);
-
-            // We parse the URL from the title starting at the end. I thinkg is
-            // far less likely to have a non URL encoded > character in the
-            // URL, than a user wanting to use > inside their title.
-            //
-            // TODO: Support another syntax for the rare case of a user that
-            // wants a > character in a URL. Or make sure URLs are URL encoded
-            // from the UI that will be used to edit this.
-            ssize_t pos = tag.content.len - 1;
-            while (pos > 0 && str_data(&tag.content)[pos] != '>') {
-                pos--;
-            }
-
-            sstring_t url = SSTRING(str_data(&tag.content), str_len(&tag.content));
-            sstring_t title = SSTRING(str_data(&tag.content), str_len(&tag.content));
-            if (pos > 0 && str_data(&tag.content)[pos - 1] == '-') {
-                pos--;
-                url = sstr_trim(SSTRING(str_data(&tag.content) + pos + 2, str_len(&tag.content) - (pos + 2)));
-                title = sstr_trim(SSTRING(str_data(&tag.content), pos));
-
-                // TODO: It would be nice to heve this API...
-                //sstr_trim(sstr_substr(pos+2));
-                //sstr_trim(sstr_substr(0, pos));
-            }
-
-            struct html_element_t *link_element = html_new_element (html, "a");
-            strn_set (&buff, url.s, url.len);
-            html_element_attribute_set (html, link_element, "href", str_data(&buff));
-            html_element_attribute_set (html, link_element, "target", "_blank");
-            html_element_append_strn (html, link_element, title.len, title.s);
-
-            psx_append_html_element(ps, html, link_element);
-            psx_tag_destroy (&tag);
-
-        } else if (ps_match(ps, TOKEN_TYPE_TAG, "youtube")) {
-            struct psx_tag_t tag = ps_parse_tag (ps);
-
-            sstring_t video_id = {0};
-            const char *error;
-            Resub m;
-            Reprog *regex = regcomp("^.*(youtu.be\\/|youtube(-nocookie)?.com\\/(v\\/|.*u\\/\\w\\/|embed\\/|.*v=))([\\w-]{11}).*", 0, &error);
-            if (!regexec(regex, str_data(&tag.content), &m, 0)) {
-                video_id = SSTRING((char*) m.sub[4].sp, m.sub[4].ep - m.sub[4].sp);
-            }
-
-            //// Assume 16:9 aspect ratio
-            double width, height;
-            compute_media_size(&tag.parameters, 16.0L/9, psx_content_width - 30, &width, &height);
-
-            struct html_element_t *html_element = html_new_element (html, "iframe");
-            str_set_printf (&buff, "%.6g", width);
-            html_element_attribute_set (html, html_element, "width", str_data(&buff));
-            str_set_printf (&buff, "%.6g", height);
-            html_element_attribute_set (html, html_element, "height", str_data(&buff));
-            html_element_attribute_set (html, html_element, "style", "margin: 0 auto; display: block;");
-            str_set_printf (&buff, "https://www.youtube-nocookie.com/embed/%.*s", video_id.len, video_id.s);
-            html_element_attribute_set (html, html_element, "src", str_data(&buff));
-            html_element_attribute_set (html, html_element, "frameborder", "0");
-            html_element_attribute_set (html, html_element, "allow", "accelerometer; autoplay; clipboard-write; encrypted-media; gyroscope; picture-in-picture");
-            html_element_attribute_set (html, html_element, "allowfullscreen", "");
-            psx_append_html_element(ps, html, html_element);
-            psx_tag_destroy (&tag);
-            regfree (regex);
-
-        } else if (ps_match(ps, TOKEN_TYPE_TAG, "image")) {
-            struct psx_tag_t tag = ps_parse_tag (ps);
-
-            struct html_element_t *img_element = html_new_element (html, "img");
-            str_set_printf (&buff, "files/%s", str_data(&tag.content));
-            html_element_attribute_set (html, img_element, "src", str_data(&buff));
-            str_set_printf (&buff, "%d", psx_content_width);
-            html_element_attribute_set (html, img_element, "width", str_data(&buff));
-            psx_append_html_element(ps, html, img_element);
-            psx_tag_destroy (&tag);
-
-        } else if (ps_match(ps, TOKEN_TYPE_TAG, "code")) {
-            ps_parse_tag_parameters(ps, NULL);
-            // TODO: Actually do something with the passed language name
-
-            string_t code_content = {0};
-            parse_balanced_brace_block(ps, &code_content);
-            if (str_len(&code_content) > 0) {
-                struct html_element_t *code_element = html_new_element (html, "code");
-                html_element_class_add(html, code_element, "code-inline");
-                html_element_append_strn (html, code_element, str_len(&code_content), str_data(&code_content));
-
-                psx_append_html_element(ps, html, code_element);
-            }
-            str_free (&code_content);
-
-        } else if (ps_match(ps, TOKEN_TYPE_TAG, "note")) {
-            struct psx_tag_t tag = ps_parse_tag (ps);
-
-            struct html_element_t *link_element = html_new_element (html, "a");
-            str_set_printf (&buff, "return open_note_by_title('%.*s');", str_len(&tag.content), str_data(&tag.content));
-            html_element_attribute_set (html, link_element, "onclick", str_data(&buff));
-            html_element_attribute_set (html, link_element, "href", "#");
-            html_element_class_add (html, link_element, "note-link");
-            html_element_append_strn (html, link_element, str_len(&tag.content), str_data(&tag.content));
-
-            psx_append_html_element(ps, html, link_element);
-            psx_tag_destroy (&tag);
-
-        } else if (ps_match(ps, TOKEN_TYPE_TAG, "html")) {
-            // TODO: How can we support '}' characters here?. I don't think
-            // assuming there will be balanced braces is an option here, as it
-            // is in the \code tag. We most likely will need to implement user
-            // defined termintating strings.
-            struct psx_tag_t tag = ps_parse_tag (ps);
-            struct psx_block_unit_t *head_unit = ps->block_unit_stack[ps->block_unit_stack_len-1];
-            html_element_append_strn (html, head_unit->html_element, str_len(&tag.content), str_data(&tag.content));
-            psx_tag_destroy (&tag);
+        } else if (ps_match(ps, TOKEN_TYPE_TAG, NULL) && (handler = psx_tag_lookup (ps->token.value)) != NULL) {
+            struct psx_block_unit_t *curr_unit = DYNAMIC_ARRAY_GET_LAST(ps->block_unit_stack);
+            handler->cb (ps, html, curr_unit->html_element, handler->user_data);
 
         } else {
             struct psx_block_unit_t *curr_unit = DYNAMIC_ARRAY_GET_LAST(ps->block_unit_stack);
@@ -904,16 +1612,35 @@ void block_content_parse_text (struct html_t *html, struct html_element_t *conta
             str_free (&buff);
         }
     }
+}
 
-    ps_destroy (ps);
-    str_free (&buff);
+void psx_block_append_span (mem_pool_t *pool, struct psx_block_t *block, sstring_t span)
+{
+    LINKED_LIST_APPEND_NEW (pool, struct sstring_ll_l, block->inline_content, new_span);
+    new_span->v = span;
+}
+
+// Extends the last span of the block up to the end of span, both must point
+// into the same string.
+void psx_block_extend_span (mem_pool_t *pool, struct psx_block_t *block, sstring_t span)
+{
+    struct sstring_ll_l *last_span = block->inline_content_end;
+    if (last_span != NULL) {
+        assert (last_span->v.s <= span.s);
+        last_span->v.len = span.s + span.len - last_span->v.s;
+
+    } else {
+        psx_block_append_span (pool, block, span);
+    }
 }
 
 struct psx_block_t* psx_leaf_block_new(mem_pool_t *pool, enum psx_block_type_t type, int margin, sstring_t inline_content)
 {
     struct psx_block_t *new_block = mem_pool_push_struct (pool, struct psx_block_t);
     *new_block = ZERO_INIT (struct psx_block_t);
-    strn_set_pooled (pool, &new_block->inline_content, inline_content.s, inline_content.len);
+    if (inline_content.len > 0) {
+        psx_block_append_span (pool, new_block, inline_content);
+    }
     new_block->type = type;
     new_block->margin = margin;
 
@@ -941,70 +1668,41 @@ struct psx_block_t* psx_push_block (struct psx_parser_state_t *ps, struct psx_bl
     return new_block;
 }
 
-//// TODO: User callbacks will be modifying the tree. It's possible the user
-//// messes up and for example adds a cycle into the tree, we should detect such
-//// problem and avoid maybe later entering an infinite loop.
-//function block_tree_user_callbacks (root, block=NULL, containing_array=NULL, index=-1)
-//{
-//    // Convenience so just a single parameter is required in the initial call
-//    if (block == NULL) block = root;
-//
-//    if (block.block_content != NULL) {
-//        block.block_content.forEach (function(sub_block, index) {
-//            block_tree_user_callbacks (root, sub_block, block.block_content, index);
-//        });
-//
-//    } else {
-//        struct psx_parser_state_t _ps = {0};
-//        struct psx_parser_state_t *ps = &_ps;
-//        ps_init (block->inline_content);
-//
-//        let string_replacements = [];
-//        while (!ps.is_eof && !ps.error) {
-//            let start = ps.pos;
-//            let tok = ps_inline_next (ps);
-//            if (ps_match(ps, TOKEN_TYPE_TAG, NULL) && __g_user_tags[tok.value] != undefined) {
-//                let user_tag = __g_user_tags[tok.value];
-//                let result = user_tag.callback (ps, root, block, user_tag.user_data);
-//
-//                if (result != NULL) {
-//                    if (typeof(result) == "string") {
-//                        string_replacements.push ([start, ps.pos, result])
-//                    } else {
-//                        containing_array.splice(index, 1, ...result);
-//                        break;
-//                    }
-//                }
-//            }
-//        }
-//
-//        for (let i=string_replacements.length - 1; i >= 0; i--) {
-//            let replacement = string_replacements [i];
-//            block.inline_content = block.inline_content.substring(0, replacement[0]) + replacement[2] + block.inline_content.substring(replacement[1]);
-//        }
-//
-//        // TODO: What will happen if a parse error occurs here?. We should print
-//        // some details about which user function failed by checking if there
-//        // is an error in ps.
-//        ps_destroy (ps);
-//    }
-//}
+void _block_tree_to_html (struct psx_parser_state_t *ps, struct html_t *html, struct psx_block_t *block,
+                          struct html_element_t *parent, struct psx_note_links_t *note_links);
+
+// Parses the inline content of block into element and appends it to parent.
+// If a tag replaced the block, the replacement is rendered instead.
+void psx_leaf_block_to_html (struct psx_parser_state_t *ps, struct html_t *html, struct psx_block_t *block,
+                             struct html_element_t *element, struct html_element_t *parent,
+                             struct psx_note_links_t *note_links)
+{
+    block_content_parse_text (ps, html, element, block->inline_content, note_links);
+
+    struct psx_block_t *replacement = ps->block_replacement;
+    if (replacement != NULL) {
+        ps->in_replacement = true;
+        _block_tree_to_html (ps, html, replacement, parent, note_links);
+        ps->in_replacement = false;
 
-void block_tree_to_html (struct html_t *html, struct psx_block_t *block,  struct html_element_t *parent)
+    } else {
+        html_element_append_child (html, parent, element);
+    }
+}
+
+void _block_tree_to_html (struct psx_parser_state_t *ps, struct html_t *html, struct psx_block_t *block,
+                          struct html_element_t *parent, struct psx_note_links_t *note_links)
 {
     string_t buff = {0};
 
     if (block->type == BLOCK_TYPE_PARAGRAPH) {
         struct html_element_t *new_dom_element = html_new_element (html, "p");
-        html_element_append_child (html, parent, new_dom_element);
-        block_content_parse_text (html, new_dom_element, str_data(&block->inline_content));
+        psx_leaf_block_to_html (ps, html, block, new_dom_element, parent, note_links);
 
     } else if (block->type == BLOCK_TYPE_HEADING) {
         str_set_printf (&buff, "h%i", block->heading_number);
         struct html_element_t *new_dom_element = html_new_element (html, str_data(&buff));
-
-        html_element_append_child (html, parent, new_dom_element);
-        block_content_parse_text (html, new_dom_element, str_data(&block->inline_content));
+        psx_leaf_block_to_html (ps, html, block, new_dom_element, parent, note_links);
 
     } else if (block->type == BLOCK_TYPE_CODE) {
         struct html_element_t *pre_element = html_new_element (html, "pre");
@@ -1016,7 +1714,8 @@ void block_tree_to_html (struct html_t *html, struct psx_block_t *block,  struct
         // column containing the numbers.
         // html_element_style_set(html, code_element, "padding-left", "0.25em");
 
-        html_element_append_cstr (html, code_element, str_data(&block->inline_content));
+        str_cat_sstring_list (&buff, block->inline_content);
+        html_element_append_strn (html, code_element, str_len(&buff), str_data(&buff));
         html_element_append_child (html, pre_element, code_element);
 
         // TODO: This hack should happen in the client side because it requires
@@ -1042,7 +1741,7 @@ void block_tree_to_html (struct html_t *html, struct psx_block_t *block,  struct
 
     } else if (block->type == BLOCK_TYPE_ROOT) {
         LINKED_LIST_FOR (struct psx_block_t*, sub_block, block->block_content) {
-            block_tree_to_html(html, sub_block, parent);
+            _block_tree_to_html (ps, html, sub_block, parent, note_links);
         }
 
     } else if (block->type == BLOCK_TYPE_LIST) {
@@ -1053,7 +1752,7 @@ void block_tree_to_html (struct html_t *html, struct psx_block_t *block,  struct
         html_element_append_child (html, parent, new_dom_element);
 
         LINKED_LIST_FOR (struct psx_block_t*, sub_block, block->block_content) {
-            block_tree_to_html(html, sub_block, new_dom_element);
+            _block_tree_to_html (ps, html, sub_block, new_dom_element, note_links);
         }
 
     } else if (block->type == BLOCK_TYPE_LIST_ITEM) {
@@ -1061,13 +1760,27 @@ void block_tree_to_html (struct html_t *html, struct psx_block_t *block,  struct
         html_element_append_child (html, parent, new_dom_element);
 
         LINKED_LIST_FOR (struct psx_block_t*, sub_block, block->block_content) {
-            block_tree_to_html(html, sub_block, new_dom_element);
+            _block_tree_to_html (ps, html, sub_block, new_dom_element, note_links);
         }
     }
 
     str_free (&buff);
 }
 
+// The inline content of all blocks is parsed with the same parser state,
+// instead of creating one for each paragraph.
+void block_tree_to_html (struct html_t *html, struct psx_block_t *block,  struct html_element_t *parent,
+                         struct psx_note_links_t *note_links)
+{
+    struct psx_parser_state_t _ps = {0};
+    struct psx_parser_state_t *ps = &_ps;
+    ps_init_spans (ps, NULL);
+
+    _block_tree_to_html (ps, html, block, parent, note_links);
+
+    ps_destroy (ps);
+}
+
 struct psx_block_t* parse_note_text(mem_pool_t *pool, char *note_text)
 {
     struct psx_parser_state_t _ps = {0};
@@ -1112,10 +1825,12 @@ struct psx_block_t* parse_note_text(mem_pool_t *pool, char *note_text)
 
             // Append all paragraph continuation lines. This ensures all paragraphs
             // found at the beginning of the iteration followed an empty line.
+            // The paragraph's span is extended over them, line breaks and
+            // indentation in between are parsed as a single space by the inline
+            // parser.
             struct psx_token_t tok_peek = ps_next_peek(ps);
             while (tok_peek.is_eol && tok_peek.type == TOKEN_TYPE_PARAGRAPH) {
-                str_cat_c(&new_paragraph->inline_content, " ");
-                strn_cat_c(&new_paragraph->inline_content, tok_peek.value.s, tok_peek.value.len);
+                psx_block_extend_span (pool, new_paragraph, tok_peek.value);
                 ps_next(ps);
 
                 tok_peek = ps_next_peek(ps);
@@ -1124,7 +1839,8 @@ struct psx_block_t* parse_note_text(mem_pool_t *pool, char *note_text)
         } else if (ps_match(ps, TOKEN_TYPE_CODE_HEADER, NULL)) {
             struct psx_block_t *new_code_block = psx_push_block (ps, psx_leaf_block_new(pool, BLOCK_TYPE_CODE, tok.margin, SSTRING("",0)));
 
-            char *start = ps->pos;
+            // Collect code lines in a single pass, leading empty lines are
+            // stripped.
             int min_leading_spaces = INT32_MAX;
             struct psx_token_t tok_peek = ps_next_peek(ps);
             while (tok_peek.is_eol && tok_peek.type == TOKEN_TYPE_CODE_LINE) {
@@ -1139,31 +1855,24 @@ struct psx_block_t* parse_note_text(mem_pool_t *pool, char *note_text)
                     if (space_count >= 0) { // Ignore empty where we couldn't find any non-whitespace character.
                         min_leading_spaces = MIN (min_leading_spaces, space_count + 1);
                     }
+
+                    psx_block_append_span (pool, new_code_block, tok_peek.value);
+
+                } else if (new_code_block->inline_content != NULL) {
+                    psx_block_append_span (pool, new_code_block, tok_peek.value);
                 }
 
                 tok_peek = ps_next_peek(ps);
             }
-            ps_next(ps);
-
-            // Concatenate lines to inline content while removing  the most
-            // leading spaces we can remove. I call this automatic space
-            // normalization.
-            ps->pos = start;
-            bool is_start = true; // Used to strip trailing empty lines.
-            tok_peek = ps_next_peek(ps);
-            while (tok_peek.is_eol && tok_peek.type == TOKEN_TYPE_CODE_LINE) {
-                ps_next(ps);
 
-                if (!is_start || !is_empty_line(tok_peek.value)) {
-                    is_start = false;
-                    if (min_leading_spaces < tok_peek.value.len) {
-                        strn_cat_c(&new_code_block->inline_content, tok_peek.value.s+min_leading_spaces, tok_peek.value.len-min_leading_spaces);
-                    } else {
-                        str_cat_c(&new_code_block->inline_content, "\n");
-                    }
+            // Remove the most leading spaces we can remove from each line. I
+            // call this automatic space normalization.
+            LINKED_LIST_FOR (struct sstring_ll_l*, line, new_code_block->inline_content) {
+                if (min_leading_spaces < line->v.len) {
+                    line->v = SSTRING(line->v.s + min_leading_spaces, line->v.len - min_leading_spaces);
+                } else {
+                    line->v = SSTRING("\n", 1);
                 }
-
-                tok_peek = ps_next_peek(ps);
             }
 
         } else if (ps_match(ps, TOKEN_TYPE_BULLET_LIST, NULL) || ps_match(ps, TOKEN_TYPE_NUMBERED_LIST, NULL)) {
@@ -1188,7 +1897,7 @@ struct psx_block_t* parse_note_text(mem_pool_t *pool, char *note_text)
                 // found at the beginning of the iteration followed an empty line.
                 tok_peek = ps_next_peek(ps);
                 while (tok_peek.is_eol && tok_peek.type == TOKEN_TYPE_PARAGRAPH) {
-                    strn_cat_c(&new_paragraph->inline_content, tok_peek.value.s, tok_peek.value.len);
+                    psx_block_extend_span (pool, new_paragraph, tok_peek.value);
                     ps_next(ps);
 
                     tok_peek = ps_next_peek(ps);
@@ -1197,7 +1906,6 @@ struct psx_block_t* parse_note_text(mem_pool_t *pool, char *note_text)
         }
     }
 
-    //block_tree_user_callbacks (root_block)
     ps_destroy (ps);
 
     return root_block;
@@ -1236,7 +1944,10 @@ void _str_cat_block_tree (string_t *str, struct psx_block_t *block, int indent,
 
     if (block->block_content == NULL) {
         str_cat_indented_printf (str, curr_indent, "inline_content:\n");
-        str_cat_indented_debug_multiline (str, curr_indent, str_data(&block->inline_content));
+        string_t inline_content = {0};
+        str_cat_sstring_list (&inline_content, block->inline_content);
+        str_cat_indented_debug_multiline (str, curr_indent, str_data(&inline_content));
+        str_free (&inline_content);
         str_cat_printf (str, "\n");
 
     } else {
@@ -1260,9 +1971,10 @@ void printf_block_tree (struct psx_block_t *root, int indent)
     str_free (&str);
 }
 
-struct html_t* markup_to_html (mem_pool_t *pool, char *markup, char *id, int x)
+// Creates the HTML of an empty note, blocks of the note are rendered into
+// html->root.
+struct html_t* note_html_new (mem_pool_t *pool, char *id, int x)
 {
-    mem_pool_t pool_l = {0};
     struct html_t *html = mem_pool_push_struct (pool, struct html_t);
     *html = ZERO_INIT (struct html_t);
     html->pool = pool;
@@ -1280,14 +1992,30 @@ struct html_t* markup_to_html (mem_pool_t *pool, char *markup, char *id, int x)
     str_set_printf (&buff, "%ipx", x);
     html_element_attribute_set (html, root, "style", str_data(&buff));
 
+    return html;
+}
+
+// If note_links is not NULL, the targets of links found in the note are
+// appended to it.
+struct html_t* markup_to_html_full (mem_pool_t *pool, char *markup, char *id, int x,
+                                    struct psx_note_links_t *note_links)
+{
+    mem_pool_t pool_l = {0};
+    struct html_t *html = note_html_new (pool, id, x);
+
     struct psx_block_t *root_block = parse_note_text(&pool_l, markup);
     //printf_block_tree (root_block, 4);
 
-    block_tree_to_html(html, root_block, root);
+    block_tree_to_html(html, root_block, html->root, note_links);
 
     mem_pool_destroy (&pool_l);
 
     return html;
 }
 
+struct html_t* markup_to_html (mem_pool_t *pool, char *markup, char *id, int x)
+{
+    return markup_to_html_full (pool, markup, id, x, NULL);
+}
+
 #endif
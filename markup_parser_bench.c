@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2021 Santiago León O.
+ */
+
+#include <time.h>
+
+#include "common.h"
+#include "binary_tree.c"
+
+#define MARKUP_PARSER_IMPL
+#include "markup_parser.h"
+
+// Measures the throughput of each stage of the parser over a corpus of notes.
+//
+// Usage:
+//  markup_parser_bench [PATH...]
+//
+// Each PATH can be a note or a directory of notes, by default the notes in
+// tests/ are used.
+
+struct bench_note_t {
+    char *markup;
+    uint64_t len;
+
+    struct bench_note_t *next;
+};
+
+struct bench_corpus_t {
+    mem_pool_t pool;
+
+    uint64_t total_len;
+    struct bench_note_t *notes;
+    struct bench_note_t *notes_end;
+};
+
+ITERATE_DIR_CB (bench_corpus_add)
+{
+    struct bench_corpus_t *corpus = (struct bench_corpus_t*)data;
+
+    if (!is_dir) {
+        LINKED_LIST_APPEND_NEW (&corpus->pool, struct bench_note_t, corpus->notes, new_note);
+        new_note->markup = full_file_read (&corpus->pool, fname, &new_note->len);
+        corpus->total_len += new_note->len;
+    }
+}
+
+double time_now ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+#define BENCH_CB(name) void name(struct bench_note_t *note)
+typedef BENCH_CB(bench_cb_t);
+
+BENCH_CB (bench_block_tokenizer)
+{
+    struct psx_parser_state_t _ps = {0};
+    struct psx_parser_state_t *ps = &_ps;
+    ps_init (ps, note->markup);
+
+    while (!ps->is_eof && !ps->error) {
+        ps_next (ps);
+    }
+
+    ps_destroy (ps);
+}
+
+BENCH_CB (bench_inline_tokenizer)
+{
+    struct psx_parser_state_t _ps = {0};
+    struct psx_parser_state_t *ps = &_ps;
+    ps_init (ps, note->markup);
+
+    while (!ps->is_eof && !ps->error) {
+        ps_inline_next (ps);
+    }
+
+    ps_destroy (ps);
+}
+
+BENCH_CB (bench_block_parser)
+{
+    mem_pool_t pool = {0};
+    parse_note_text (&pool, note->markup);
+    mem_pool_destroy (&pool);
+}
+
+BENCH_CB (bench_render)
+{
+    mem_pool_t pool = {0};
+    struct html_t *html = markup_to_html (&pool, note->markup, "1", 0);
+    html_to_str (html, &pool, 2);
+    mem_pool_destroy (&pool);
+}
+
+void bench_run (char *name, struct bench_corpus_t *corpus, bench_cb_t *cb)
+{
+    int repetitions = 0;
+    double start = time_now ();
+    double elapsed;
+    do {
+        LINKED_LIST_FOR (struct bench_note_t*, note, corpus->notes) {
+            cb (note);
+        }
+        repetitions++;
+        elapsed = time_now () - start;
+    } while (elapsed < 0.5);
+
+    printf ("%-20s %10.2f MB/s\n", name, (double)corpus->total_len*repetitions/elapsed/megabyte(1));
+}
+
+int main (int argc, char **argv)
+{
+    struct bench_corpus_t corpus = {0};
+
+    if (argc > 1) {
+        for (int i=1; i<argc; i++) {
+            if (dir_exists (argv[i])) {
+                iterate_dir (argv[i], bench_corpus_add, &corpus);
+            } else {
+                bench_corpus_add (argv[i], false, &corpus);
+            }
+        }
+
+    } else {
+        iterate_dir ("tests", bench_corpus_add, &corpus);
+    }
+
+    if (corpus.notes == NULL) {
+        printf ("No notes found.\n");
+        return 1;
+    }
+
+    printf ("Corpus of %" PRIu64 " bytes\n", corpus.total_len);
+    bench_run ("Block tokenizer", &corpus, bench_block_tokenizer);
+    bench_run ("Inline tokenizer", &corpus, bench_inline_tokenizer);
+    bench_run ("Block parser", &corpus, bench_block_parser);
+    bench_run ("Render", &corpus, bench_render);
+
+    mem_pool_destroy (&corpus.pool);
+    regcomp_cache_destroy ();
+
+    return 0;
+}
@@ -8,10 +8,690 @@
 #define MARKUP_PARSER_IMPL
 #include "markup_parser.h"
 
+// Besides rendering a test note to stdout, this checks the behavior of the
+// data structures the parser and the renderer are built on. Failed checks are
+// reported in stderr and make the program exit with an error.
+
+int num_checks = 0;
+int num_failed_checks = 0;
+
+#define CHECK(COND) test_check (COND, __FILE__, __LINE__, "%s", #COND)
+#define CHECK_MSG(COND,...) test_check (COND, __FILE__, __LINE__, __VA_ARGS__)
+GCC_PRINTF_FORMAT(4, 5)
+bool test_check (bool cond, char *file, int line, char *format, ...)
+{
+    num_checks++;
+    if (!cond) {
+        num_failed_checks++;
+        fprintf (stderr, "%s:%d: check failed: ", file, line);
+
+        va_list args;
+        va_start (args, format);
+        vfprintf (stderr, format, args);
+        va_end (args);
+
+        fprintf (stderr, "\n");
+    }
+
+    return cond;
+}
+
+//////////////////////
+// HASH MAP
+
+CSTR_HASH_MAP_NEW (test_cstr, int)
+
+// All keys hash to the same value, so every lookup has to probe past the
+// entries of other keys.
+HASH_MAP_NEW (test_collide, int, int, 7, a == b, key)
+
+void test_hash_map ()
+{
+    mem_pool_t pool = {0};
+
+    {
+        struct test_cstr_map_t map = {0};
+        CHECK (!test_cstr_map_lookup (&map, "missing", NULL));
+        CHECK (test_cstr_map_get (&map, "missing") == 0);
+
+        // Keys are copied into the map, the buffer is reused on purpose.
+        char key[32];
+        int num_keys = 1000;
+        for (int i=0; i<num_keys; i++) {
+            snprintf (key, sizeof(key), "key %d", i);
+            test_cstr_map_insert (&map, key, i);
+
+            // The table is kept at most half full.
+            CHECK (2*map.num_entries <= map.capacity);
+        }
+        CHECK (map.num_entries == num_keys);
+        CHECK ((map.capacity & (map.capacity - 1)) == 0);
+
+        int num_found = 0;
+        for (int i=0; i<num_keys; i++) {
+            snprintf (key, sizeof(key), "key %d", i);
+            int value = -1;
+            if (test_cstr_map_maybe_get (&map, key, &value) && value == i) {
+                num_found++;
+            }
+        }
+        CHECK_MSG (num_found == num_keys, "found %d of %d keys after growing", num_found, num_keys);
+
+        CHECK (!test_cstr_map_lookup (&map, "key 1000", NULL));
+        CHECK (!test_cstr_map_lookup (&map, "key", NULL));
+
+        // Inserting an existing key does nothing.
+        test_cstr_map_insert (&map, "key 10", 42);
+        CHECK (map.num_entries == num_keys);
+        CHECK (test_cstr_map_get (&map, "key 10") == 10);
+
+        // Entries are iterated in insertion order.
+        int i = 0;
+        bool in_order = true;
+        HASH_MAP_FOR (test_cstr, &map, entry) {
+            snprintf (key, sizeof(key), "key %d", i);
+            if (strcmp (entry->key, key) != 0 || entry->value != i) in_order = false;
+            i++;
+        }
+        CHECK (in_order && i == num_keys);
+
+        test_cstr_map_destroy (&map);
+    }
+
+    {
+        struct test_collide_map_t map = {0};
+        map.pool = &pool;
+
+        for (int i=0; i<100; i++) {
+            test_collide_map_insert (&map, i, 2*i);
+        }
+        test_collide_map_insert (&map, 50, 0);
+        CHECK (map.num_entries == 100);
+
+        int num_found = 0;
+        for (int i=0; i<100; i++) {
+            int value = -1;
+            if (test_collide_map_maybe_get (&map, i, &value) && value == 2*i) {
+                num_found++;
+            }
+        }
+        CHECK_MSG (num_found == 100, "found %d of 100 colliding keys", num_found);
+        CHECK (!test_collide_map_lookup (&map, 100, NULL));
+        CHECK (!test_collide_map_lookup (&map, -1, NULL));
+
+        // A map without entries can be looked up, even when it has no table.
+        struct test_collide_map_t empty = {0};
+        CHECK (!test_collide_map_lookup (&empty, 7, NULL));
+    }
+
+    mem_pool_destroy (&pool);
+}
+
+//////////////////////
+// BINARY TREE
+
+BINARY_TREE_NEW_BALANCED (test_avl, int, int, a - b)
+BINARY_TREE_NEW (test_unbalanced, int, int, a - b)
+
+// Returns the height of the subtree at node, or -1 if it isn't an AVL tree
+// with keys in (min, max) and correct heights stored in its nodes.
+int test_avl_check_node (struct test_avl_tree_node_t *node, int min, int max, uint32_t *num_nodes)
+{
+    if (node == NULL) return 0;
+    if (node->key <= min || node->key >= max) return -1;
+
+    int left = test_avl_check_node (node->left, min, node->key, num_nodes);
+    int right = test_avl_check_node (node->right, node->key, max, num_nodes);
+    if (left == -1 || right == -1 || abs(left - right) > 1) return -1;
+
+    int height = 1 + MAX (left, right);
+    if (node->height != height) return -1;
+
+    (*num_nodes)++;
+    return height;
+}
+
+bool test_avl_is_valid (struct test_avl_tree_t *tree)
+{
+    uint32_t num_nodes = 0;
+    int height = test_avl_check_node (tree->root, INT_MIN, INT_MAX, &num_nodes);
+    return height != -1 && height == tree->height && num_nodes == tree->num_nodes;
+}
+
+// Checks the tree contains exactly the keys i for which present[i] is true,
+// with value 10*i, visiting them in order with BINARY_TREE_FOR.
+bool test_avl_has_keys (struct test_avl_tree_t *tree, bool *present, int num_keys)
+{
+    int next = 0;
+    bool success = true;
+    BINARY_TREE_FOR (test_avl, tree, node) {
+        while (next < num_keys && !present[next]) next++;
+        if (node->key != next || node->value != 10*next) success = false;
+        next++;
+    }
+    while (next < num_keys && !present[next]) next++;
+
+    return success && next >= num_keys;
+}
+
+void test_binary_tree ()
+{
+    {
+        // Sorted insertion is the worst case of an unbalanced tree, here
+        // 2^10-1 keys must end up in a perfect tree.
+        struct test_avl_tree_t tree = {0};
+        for (int i=0; i<1023; i++) {
+            test_avl_tree_insert (&tree, i, 10*i);
+        }
+        CHECK (tree.num_nodes == 1023);
+        CHECK_MSG (tree.height == 10, "height %u after sorted inserts", tree.height);
+        CHECK (test_avl_is_valid (&tree));
+
+        // Inserting an existing key does nothing.
+        test_avl_tree_insert (&tree, 500, 0);
+        CHECK (tree.num_nodes == 1023);
+        CHECK (test_avl_get (&tree, 500) == 5000);
+
+        test_avl_tree_destroy (&tree);
+
+        // Descending order exercises the rotations of the other side.
+        tree = ZERO_INIT (struct test_avl_tree_t);
+        for (int i=1022; i>=0; i--) {
+            test_avl_tree_insert (&tree, i, 10*i);
+        }
+        CHECK_MSG (tree.height == 10, "height %u after reverse sorted inserts", tree.height);
+        CHECK (test_avl_is_valid (&tree));
+
+        test_avl_tree_destroy (&tree);
+    }
+
+    {
+        // The root 4 has children 2 and 6, 1, 3 and 5 are leaves, 7 only has
+        // a right child, 8.
+        struct test_avl_tree_t tree = {0};
+        int keys[] = {4, 2, 6, 1, 3, 5, 7, 8};
+        bool present[9] = {0};
+        for (int i=0; i<ARRAY_SIZE(keys); i++) {
+            test_avl_tree_insert (&tree, keys[i], 10*keys[i]);
+            present[keys[i]] = true;
+        }
+        CHECK (test_avl_is_valid (&tree) && tree.root->key == 4);
+        CHECK (test_avl_has_keys (&tree, present, ARRAY_SIZE(present)));
+
+        int removed_key = 0, removed_value = 0;
+        CHECK (!test_avl_tree_remove (&tree, 9, NULL, NULL));
+        CHECK (tree.num_nodes == 8 && tree.free_nodes == NULL);
+
+        // Leaf.
+        CHECK (test_avl_tree_remove (&tree, 1, &removed_key, &removed_value));
+        CHECK (removed_key == 1 && removed_value == 10);
+        present[1] = false;
+        CHECK (test_avl_is_valid (&tree));
+        CHECK (test_avl_has_keys (&tree, present, ARRAY_SIZE(present)));
+        CHECK (!test_avl_tree_lookup (&tree, 1, NULL));
+
+        // One child.
+        CHECK (test_avl_tree_remove (&tree, 7, &removed_key, &removed_value));
+        CHECK (removed_key == 7 && removed_value == 70);
+        present[7] = false;
+        CHECK (test_avl_is_valid (&tree));
+        CHECK (test_avl_has_keys (&tree, present, ARRAY_SIZE(present)));
+
+        // Two children, the root is replaced by its successor.
+        CHECK (test_avl_tree_remove (&tree, 4, &removed_key, &removed_value));
+        CHECK (removed_key == 4 && removed_value == 40);
+        present[4] = false;
+        CHECK (test_avl_is_valid (&tree) && tree.root->key == 5);
+        CHECK (test_avl_has_keys (&tree, present, ARRAY_SIZE(present)));
+        CHECK (tree.num_nodes == 5);
+
+        // Removed nodes are reused by later insertions, the most recently
+        // removed one first.
+        struct test_avl_tree_node_t *free_node = tree.free_nodes;
+        test_avl_tree_insert (&tree, 4, 40);
+        present[4] = true;
+        struct test_avl_tree_node_t *node;
+        CHECK (test_avl_tree_lookup (&tree, 4, &node) && node == free_node);
+        CHECK (test_avl_is_valid (&tree));
+        CHECK (test_avl_has_keys (&tree, present, ARRAY_SIZE(present)));
+
+        test_avl_tree_destroy (&tree);
+    }
+
+    {
+        // Remove half the keys in random order, then everything.
+        struct test_avl_tree_t tree = {0};
+        int num_keys = 1000;
+        int *order = malloc (num_keys*sizeof(int));
+        bool *present = calloc (num_keys, sizeof(bool));
+        for (int i=0; i<num_keys; i++) order[i] = i;
+
+        srand (1);
+        for (int i=num_keys-1; i>0; i--) {
+            int j = rand () % (i + 1);
+            int tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+
+        for (int i=0; i<num_keys; i++) {
+            test_avl_tree_insert (&tree, order[i], 10*order[i]);
+            present[order[i]] = true;
+        }
+        CHECK (test_avl_is_valid (&tree));
+
+        bool valid = true;
+        for (int i=0; i<num_keys/2; i++) {
+            int key = order[(7*i) % num_keys];
+            if (present[key] != test_avl_tree_remove (&tree, key, NULL, NULL)) valid = false;
+            present[key] = false;
+            if (i % 50 == 0 && !test_avl_is_valid (&tree)) valid = false;
+        }
+        CHECK (valid && test_avl_is_valid (&tree));
+        CHECK (test_avl_has_keys (&tree, present, num_keys));
+
+        for (int i=0; i<num_keys; i++) {
+            test_avl_tree_remove (&tree, i, NULL, NULL);
+        }
+        CHECK (tree.root == NULL && tree.num_nodes == 0 && tree.height == 0);
+
+        free (order);
+        free (present);
+        test_avl_tree_destroy (&tree);
+    }
+
+    {
+        // A degenerate tree is taller than the stack BINARY_TREE_FOR keeps in
+        // the loop context, iterating it allocates one.
+        struct test_unbalanced_tree_t tree = {0};
+        for (int i=0; i<100; i++) {
+            test_unbalanced_tree_insert (&tree, i, i);
+        }
+        CHECK (tree.height == 100);
+
+        int next = 0;
+        bool in_order = true;
+        BINARY_TREE_FOR (test_unbalanced, &tree, node) {
+            if (node->key != next) in_order = false;
+            next++;
+        }
+        CHECK (in_order && next == 100);
+
+        test_unbalanced_tree_destroy (&tree);
+    }
+}
+
+//////////////////////
+// HTML ESCAPING
+
+// Straightforward escaping, one character at a time.
+void test_escape_reference (string_t *str, char *data, size_t len, bool is_attribute)
+{
+    for (size_t i=0; i<len; i++) {
+        switch (data[i]) {
+            case '<': str_cat_c (str, "&lt;"); break;
+            case '>': str_cat_c (str, "&gt;"); break;
+            case '&': str_cat_c (str, "&amp;"); break;
+            case '"': str_cat_c (str, is_attribute ? "&quot;" : "\""); break;
+            default: strn_cat_c (str, data + i, 1);
+        }
+    }
+}
+
+bool test_escape_matches (char *data, size_t len, bool is_attribute)
+{
+    string_t expected = {0};
+    test_escape_reference (&expected, data, len, is_attribute);
+
+    string_t result = {0};
+    struct html_writer_t *w = malloc (sizeof(struct html_writer_t));
+    html_writer_init (w, NULL, html_write_str_cb, &result);
+    html_writer_write_escaped (w, data, len, is_attribute);
+    html_writer_flush (w);
+    free (w);
+
+    bool success = strcmp (str_data(&result), str_data(&expected)) == 0;
+    str_free (&expected);
+    str_free (&result);
+    return success;
+}
+
+void test_html_escape ()
+{
+    // Characters are scanned in chunks of 16 or 32 bytes, put a character
+    // that needs escaping at every position around the chunk edges, alone and
+    // followed by another one at the end.
+    char specials[] = "<>&\"'";
+    char buffer[100];
+    for (size_t len=1; len<=80; len++) {
+        for (size_t pos=0; pos<len; pos++) {
+            for (char *c=specials; *c; c++) {
+                memset (buffer, 'x', len);
+                buffer[len] = '\0';
+                buffer[pos] = *c;
+
+                size_t expected_pos = *c == '\'' ? len : pos;
+                CHECK_MSG (html_escape_scan (buffer, len) == expected_pos,
+                           "scan of '%c' at %zu of %zu", *c, pos, len);
+
+                buffer[len - 1] = specials[(pos + len) % 4];
+                CHECK_MSG (test_escape_matches (buffer, len, false), "text '%c' at %zu of %zu", *c, pos, len);
+                CHECK_MSG (test_escape_matches (buffer, len, true), "attribute '%c' at %zu of %zu", *c, pos, len);
+            }
+        }
+    }
+
+    // Only len bytes are scanned, even if what follows needs escaping.
+    CHECK (html_escape_scan ("xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx<", 64) == 64);
+
+    // Longer than the writer's buffer, with sparse characters to escape.
+    size_t long_len = 3*HTML_WRITER_BUFFER_SIZE + 7;
+    char *long_text = malloc (long_len);
+    srand (1);
+    for (size_t i=0; i<long_len; i++) {
+        long_text[i] = rand () % 50 == 0 ? specials[rand () % 5] : 'a' + i % 26;
+    }
+    CHECK (test_escape_matches (long_text, long_len, false));
+    CHECK (test_escape_matches (long_text, long_len, true));
+    free (long_text);
+
+    // Escaping when serializing elements.
+    mem_pool_t pool = {0};
+    struct html_t html = {0};
+    html.pool = &pool;
+    struct html_element_t *element = html_new_element (&html, "span");
+    html_element_attribute_set (&html, element, "title", "0123456789abcde\"<b> & 'c'\"");
+    html_element_append_cstr (&html, element, "0123456789abcdef0123456789abcd<\"&\">");
+    html_element_append_raw_strn (&html, element, 7, "<b>&</b>");
+    char *str = html_to_str (&html, &pool, 0);
+    char *expected = "<span title=\"0123456789abcde&quot;&lt;b&gt; &amp; 'c'&quot;\">"
+                     "0123456789abcdef0123456789abcd&lt;\"&amp;\"&gt;<b>&</b</span>";
+    CHECK_MSG (strcmp (str, expected) == 0, "serialized element is %s", str);
+    mem_pool_destroy (&pool);
+}
+
+void test_html_attributes ()
+{
+    mem_pool_t pool = {0};
+    struct html_t html = {0};
+    html.pool = &pool;
+
+    // Attributes are written sorted by name whatever the order they were set
+    // in, including names that aren't predefined atoms.
+    struct html_element_t *element = html_new_element (&html, "a");
+    char *names[] = {"title", "href", "data-b", "class", "onclick", "data-a", "id", "style"};
+    for (int i=0; i<ARRAY_SIZE(names); i++) {
+        html_element_attribute_set (&html, element, names[i], names[i]);
+    }
+    html_element_attribute_set (&html, element, "href", "#");
+    html_element_class_add (&html, element, "note-link");
+    html_element_attribute_remove (&html, element, "style");
+    html_element_attribute_remove (&html, element, "data-a");
+    html_element_attribute_remove (&html, element, "missing");
+
+    // Removed nodes are reused.
+    html_element_attribute_set (&html, element, "target", "_blank");
+
+    char *str = html_to_str (&html, &pool, 0);
+    char *expected = "<a class=\"class,note-link\" data-b=\"data-b\" href=\"#\" id=\"id\" "
+                     "onclick=\"onclick\" target=\"_blank\" title=\"title\"></a>";
+    CHECK_MSG (strcmp (str, expected) == 0, "serialized element is %s", str);
+    CHECK (element->attributes.num_nodes == 7);
+    CHECK (element->attributes.free_nodes != NULL && element->attributes.free_nodes->right == NULL);
+
+    mem_pool_destroy (&pool);
+}
+
+//////////////////////
+// REGULAR EXPRESSIONS
+
+struct test_regex_t {
+    char *pattern;
+    int flags;
+    char *str;
+
+    // Span of the whole match, start is -1 if there's no match.
+    int start;
+    int end;
+};
+
+// Patterns that can match the empty string can match at any position, these
+// must not skip positions based on the bytes a match starts with.
+struct test_regex_t test_regex_nullable[] = {
+    {"b*",       0,         "",        0,  0},
+    {"b*",       0,         "_",       0,  0},
+    {"x?",       0,         "_ a_ xx", 0,  0},
+    {"(a|)",     0,         "b",       0,  0},
+    {"a|b*",     0,         "cb",      0,  0},
+    {"(ab)*",    0,         "cab",     0,  0},
+    {"a{0,2}b?", REG_ICASE, "XAAB",    0,  0},
+    {"a*$",      0,         "baa",     1,  3},
+    {"b*$",      0,         "ab_",     3,  3},
+    {"\\b",      0,         " a",      1,  1},
+    {"$",        0,         "ab",      2,  2},
+    {"^$",       0,         "",        0,  0},
+    {".*",       0,         "xy",      0,  2},
+};
+
+struct test_regex_t test_regex_start[] = {
+    {"xx",       0,           "_ a_ xx", 5,  7},
+    {"b+",       0,           "aab",     2,  3},
+    {"[ab]*c",   0,           "xxabc",   2,  5},
+    {"B",        REG_ICASE,   "aab",     2,  3},
+    {"^a",       0,           "ba",      -1, -1},
+    {"^b",       REG_NEWLINE, "a\nb",    2,  3},
+};
+
+void test_regex_cases (struct test_regex_t *cases, int num_cases)
+{
+    for (int i=0; i<num_cases; i++) {
+        struct test_regex_t *c = &cases[i];
+
+        // Check both matchers, the backtracking one and REG_LINEAR.
+        for (int linear=0; linear<2; linear++) {
+            const char *error;
+            Reprog *regex = regcomp (c->pattern, c->flags | (linear ? REG_LINEAR : 0), &error);
+            if (!CHECK_MSG (regex != NULL, "failed to compile %s: %s", c->pattern, error)) continue;
+
+            Resub m;
+            int start = -1, end = -1;
+            if (regexec (regex, c->str, &m, 0) == 0) {
+                start = m.sub[0].sp - c->str;
+                end = m.sub[0].ep - c->str;
+            }
+            CHECK_MSG (start == c->start && end == c->end,
+                       "%s on '%s'%s matched %d-%d, expected %d-%d", c->pattern, c->str,
+                       linear ? " with REG_LINEAR" : "", start, end, c->start, c->end);
+
+            regfree (regex);
+        }
+    }
+}
+
+// Formats the result of regexec() as the spans of all submatches.
+void test_regex_result (string_t *str, int status, Resub *m, char *s)
+{
+    str_set (str, "");
+    if (status != 0) {
+        str_cat_c (str, " no match");
+        return;
+    }
+
+    for (unsigned i=0; i<m->nsub; i++) {
+        if (m->sub[i].sp != NULL) {
+            str_cat_printf (str, " %d-%d", (int)(m->sub[i].sp - s), (int)(m->sub[i].ep - s));
+        } else {
+            str_cat_c (str, " -");
+        }
+    }
+}
+
+// Tries the backtracking matcher at every position of s, without skipping the
+// ones where regexec() determines a match can't start.
+int test_regexec_every_position (Reprog *prog, const char *s, Resub *sub, int eflags)
+{
+    const char *bol = s;
+    int flags = prog->flags | eflags;
+
+    sub->nsub = prog->nsub;
+    for (int i=0; i<MAXSUB; i++) {
+        sub->sub[i].sp = sub->sub[i].ep = NULL;
+    }
+
+    for (const char *sp = s; ; sp++) {
+        Resub m = *sub;
+        if (match (prog->start, sp, bol, flags, &m)) {
+            *sub = m;
+            return 0;
+        }
+        if (*sp == '\0') break;
+    }
+
+    return 1;
+}
+
+// Both matchers, the backtracking one and REG_LINEAR, must find the same match
+// and submatches as trying every position, on random patterns that are
+// nullable, anchored or neither. Lookaheads and backreferences aren't
+// supported by REG_LINEAR.
+void test_regex_linear ()
+{
+    char *atoms[] = {"a", "b", "x", "_", " ", ".", "[ab]", "[^a]", "\\w", "\\s", "\\d", "\\b",
+                     "^", "$", "(a|)", "(ab|a)", "(x)", "(a*)", "(b|x)+", "ab"};
+    char *quantifiers[] = {"", "", "", "*", "+", "?", "{1,2}", "*?"};
+    char *alphabet = "abx_ \n1";
+    int flag_options[] = {0, REG_ICASE, REG_NEWLINE};
+
+    string_t pattern = {0};
+    string_t expected = {0};
+    string_t result = {0};
+    string_t linear_result = {0};
+    char str[16];
+
+    srand (1);
+    int num_cases = 0, num_different = 0;
+    for (int i=0; i<3000; i++) {
+        str_set (&pattern, "");
+        int num_atoms = 1 + rand () % 4;
+        for (int j=0; j<num_atoms; j++) {
+            // str_cat_c() evaluates its argument twice.
+            char *atom = atoms[rand () % ARRAY_SIZE(atoms)];
+            char *quantifier = quantifiers[rand () % ARRAY_SIZE(quantifiers)];
+            str_cat_c (&pattern, atom);
+            str_cat_c (&pattern, quantifier);
+        }
+        if (rand () % 5 == 0) {
+            str_cat_printf (&pattern, "|%s", atoms[rand () % ARRAY_SIZE(atoms)]);
+        }
+
+        int flags = flag_options[rand () % ARRAY_SIZE(flag_options)];
+        const char *error;
+        Reprog *backtrack = regcomp (str_data(&pattern), flags, &error);
+        Reprog *linear = regcomp (str_data(&pattern), flags | REG_LINEAR, &error);
+        if (!CHECK_MSG ((backtrack == NULL) == (linear == NULL), "only one matcher compiled %s", str_data(&pattern))
+            || backtrack == NULL) {
+            regfree (backtrack);
+            regfree (linear);
+            continue;
+        }
+
+        for (int j=0; j<4; j++) {
+            int len = rand () % 12;
+            for (int k=0; k<len; k++) {
+                str[k] = alphabet[rand () % strlen(alphabet)];
+            }
+            str[len] = '\0';
+            int eflags = rand () % 4 == 0 ? REG_NOTBOL : 0;
+
+            Resub m;
+            test_regex_result (&expected, test_regexec_every_position (backtrack, str, &m, eflags), &m, str);
+            test_regex_result (&result, regexec (backtrack, str, &m, eflags), &m, str);
+            test_regex_result (&linear_result, regexec (linear, str, &m, eflags), &m, str);
+
+            num_cases++;
+            if (strcmp (str_data(&expected), str_data(&result)) != 0 ||
+                strcmp (str_data(&expected), str_data(&linear_result)) != 0) {
+                num_different++;
+                if (num_different <= 10) {
+                    fprintf (stderr, "%s on '%s' (flags %d, eflags %d): expected%s, backtracking%s, REG_LINEAR%s\n",
+                             str_data(&pattern), str, flags, eflags,
+                             str_data(&expected), str_data(&result), str_data(&linear_result));
+                }
+            }
+        }
+
+        regfree (backtrack);
+        regfree (linear);
+    }
+    CHECK_MSG (num_different == 0, "matchers differ in %d of %d cases", num_different, num_cases);
+
+    str_free (&pattern);
+    str_free (&expected);
+    str_free (&result);
+    str_free (&linear_result);
+}
+
+void test_regex ()
+{
+    test_regex_cases (test_regex_nullable, ARRAY_SIZE(test_regex_nullable));
+    test_regex_cases (test_regex_start, ARRAY_SIZE(test_regex_start));
+    test_regex_linear ();
+}
+
+//////////////////////
+// SCANNERS
+
+// Scanners must find the same position as scanning one byte at a time, and
+// never read past end. Buffers are allocated with the exact size so reading
+// past them is reported when built with -fsanitize=address.
+void test_scanners ()
+{
+    char *alphabet = "ab \t\n{";
+    for (size_t len=0; len<=80; len++) {
+        char *buffer = malloc (len + 1);
+
+        srand (len);
+        for (int i=0; i<20; i++) {
+            // Mostly one character repeated, so scans cover several chunks.
+            char fill = alphabet[rand () % 3];
+            for (size_t j=0; j<len; j++) {
+                buffer[j] = rand () % 16 == 0 ? alphabet[rand () % strlen(alphabet)] : fill;
+            }
+            buffer[len] = '\0';
+
+            for (size_t start=0; start<=len; start++) {
+                char *s = buffer + start;
+                char *end = buffer + len;
+
+                char *expected = s;
+                while (expected < end && *expected != '\n') expected++;
+                CHECK_MSG (psx_scan_line_end (s, end) == expected, "line end from %zu of %zu", start, len);
+
+                expected = s;
+                while (expected < end && !char_is_class (*expected, PSX_CHAR_TEXT_END)) expected++;
+                CHECK_MSG (psx_scan_text_end (s, end) == expected, "text end from %zu of %zu", start, len);
+
+                expected = s;
+                while (expected < end && (*expected == ' ' || *expected == '\t')) expected++;
+                CHECK_MSG (psx_skip_spaces (s, end) == expected, "spaces from %zu of %zu", start, len);
+            }
+        }
+
+        free (buffer);
+    }
+}
+
 int main(int argc, char** argv)
 {
     mem_pool_t pool = {0};
 
+    test_hash_map ();
+    test_binary_tree ();
+    test_html_escape ();
+    test_html_attributes ();
+    test_regex ();
+    test_scanners ();
+
     //char *test_note = full_file_read (&pool, "tests/title_and_paragraphs.psplx", NULL);
     //char *test_note = full_file_read (&pool, "tests/code.psplx", NULL);
     //char *test_note = full_file_read (&pool, "tests/lists.psplx", NULL);
@@ -20,5 +700,10 @@ int main(int argc, char** argv)
     printf ("%s\n", html_to_str (html, &pool, 2));
     html_destroy (html);
 
+    if (num_failed_checks > 0) {
+        fprintf (stderr, "%d of %d checks failed\n", num_failed_checks, num_checks);
+        return 1;
+    }
+
     return 0;
 }
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2021 Santiago León O.
+ */
+
+// Content addressed cache of math rendered to HTML. There's no TeX engine
+// here, math is rendered by an external process, math_renderer.js uses the
+// same KaTeX the client would use. The cache only keeps track of what's
+// missing and hands it over to the renderer.
+//
+// Each formula is identified by the hash of its TeX and display mode, so the
+// same formula used in many notes is stored and rendered once, and formulas
+// that didn't change are never rendered again. The cache is a directory
+// containing, for each key:
+//
+//  <key>.html  The rendered formula, written by the renderer.
+//  <key>.tex   A request to render it. The first line is "inline" or
+//              "display", the rest is the TeX.
+//
+// Usage:
+//
+//  struct math_cache_t cache = {0};
+//  math_cache_init (&cache, dir);
+//
+//  char *html = math_cache_get (&cache, tex, display_mode);
+//  if (html == NULL) {
+//      // Not rendered yet, it will be requested by math_cache_flush().
+//  }
+//  ...
+//  math_cache_flush (&cache, renderer);
+//
+//  math_cache_destroy (&cache);
+//
+// math_cache_get() can be called from multiple threads. Formulas are read
+// from the directory the first time they are used and kept in memory until
+// the cache is destroyed.
+
+#include <pthread.h>
+
+struct math_cache_entry_t {
+    uint64_t key;
+    char *tex;
+    bool display_mode;
+
+    // NULL if the formula isn't rendered.
+    char *html;
+    // The directory must be checked for the formula, either because it was
+    // never looked up or because the renderer ran after it was missing.
+    bool needs_check;
+
+    struct math_cache_entry_t *next_missing;
+};
+
+HASH_MAP_NEW (math_cache, uint64_t, struct math_cache_entry_t*, key, a == b, key)
+
+struct math_cache_t {
+    mem_pool_t pool;
+    char *dir;
+
+    pthread_mutex_t lock;
+    struct math_cache_map_t entries;
+
+    // Formulas looked up and not found since the last math_cache_flush().
+    int num_missing;
+    struct math_cache_entry_t *missing;
+};
+
+void math_cache_init (struct math_cache_t *cache, char *dir);
+char* math_cache_get (struct math_cache_t *cache, char *tex, bool display_mode);
+bool math_cache_flush (struct math_cache_t *cache, char *renderer);
+void math_cache_destroy (struct math_cache_t *cache);
+
+#if defined(MATH_CACHE_IMPL)
+
+void math_cache_init (struct math_cache_t *cache, char *dir)
+{
+    cache->dir = pom_strdup (&cache->pool, dir);
+    pthread_mutex_init (&cache->lock, NULL);
+    cache->entries.pool = &cache->pool;
+}
+
+uint64_t math_cache_key (char *tex, bool display_mode)
+{
+    uint64_t key = FNV1A_64_OFFSET_BASIS;
+    key = fnv1a_64_update (key, display_mode ? "D" : "I", 1);
+    key = fnv1a_64_update (key, tex, strlen(tex));
+    return key;
+}
+
+// Returns a malloc()'d copy of the rendered formula, or NULL if it's not in
+// the directory. Not finding it is expected, so it isn't reported as an
+// error.
+char* math_cache_read (struct math_cache_t *cache, uint64_t key)
+{
+    char path[PATH_MAX];
+    snprintf (path, sizeof(path), "%s/%016" PRIx64 ".html", cache->dir, key);
+
+    int fd = open (path, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    char *html = NULL;
+    struct stat st;
+    if (fstat (fd, &st) == 0) {
+        html = malloc (st.st_size + 1);
+
+        ssize_t bytes_read = 0;
+        while (bytes_read < st.st_size) {
+            ssize_t status = read (fd, html + bytes_read, st.st_size - bytes_read);
+            if (status <= 0) {
+                printf ("Error reading %s: %s\n", path, status == 0 ? "Unexpected end of file" : strerror(errno));
+                free (html);
+                html = NULL;
+                break;
+            }
+            bytes_read += status;
+        }
+
+        if (html != NULL) html[st.st_size] = '\0';
+    }
+
+    close (fd);
+
+    return html;
+}
+
+char* math_cache_get (struct math_cache_t *cache, char *tex, bool display_mode)
+{
+    uint64_t key = math_cache_key (tex, display_mode);
+
+    pthread_mutex_lock (&cache->lock);
+    struct math_cache_entry_t *entry = math_cache_map_get (&cache->entries, key);
+    if (entry == NULL) {
+        entry = mem_pool_push_struct (&cache->pool, struct math_cache_entry_t);
+        *entry = ZERO_INIT (struct math_cache_entry_t);
+        entry->key = key;
+        entry->tex = pom_strdup (&cache->pool, tex);
+        entry->display_mode = display_mode;
+        entry->needs_check = true;
+        math_cache_map_insert (&cache->entries, key, entry);
+    }
+
+    bool needs_check = entry->needs_check;
+    char *html = entry->html;
+    pthread_mutex_unlock (&cache->lock);
+
+    if (needs_check) {
+        // Read without holding the lock, other threads may look up the same
+        // formula meanwhile, the first one to finish fills the entry.
+        char *new_html = math_cache_read (cache, key);
+
+        pthread_mutex_lock (&cache->lock);
+        if (entry->needs_check) {
+            entry->needs_check = false;
+            if (new_html != NULL) {
+                entry->html = pom_strdup (&cache->pool, new_html);
+
+            } else {
+                entry->next_missing = cache->missing;
+                cache->missing = entry;
+                cache->num_missing++;
+            }
+        }
+        html = entry->html;
+        pthread_mutex_unlock (&cache->lock);
+
+        free (new_html);
+    }
+
+    return html;
+}
+
+// Writes a request for each missing formula, then runs renderer, if it's not
+// NULL, passing it the cache directory. Formulas that were missing are looked
+// up again next time they are used. Returns false if a request couldn't be
+// written or the renderer failed.
+//
+// Requests are kept in the directory until the renderer removes them, so a
+// renderer can also be run later, independently of the build.
+bool math_cache_flush (struct math_cache_t *cache, char *renderer)
+{
+    bool success = true;
+
+    if (cache->num_missing == 0) return success;
+
+    mem_pool_t pool = {0};
+    pthread_mutex_lock (&cache->lock);
+
+    string_t request = {0};
+    for (struct math_cache_entry_t *entry = cache->missing; entry != NULL; entry = entry->next_missing) {
+        char *path = pprintf (&pool, "%s/%016" PRIx64 ".tex", cache->dir, entry->key);
+        if (path_exists (path)) continue;
+
+        str_set_printf (&request, "%s\n%s", entry->display_mode ? "display" : "inline", entry->tex);
+        if (full_file_write (str_data(&request), str_len(&request), path)) {
+            success = false;
+        }
+    }
+    str_free (&request);
+
+    if (success && renderer != NULL) {
+        char *command = pprintf (&pool, "%s '%s'", renderer, cache->dir);
+        int status = system (command);
+        if (status != 0) {
+            printf ("Math renderer failed: %s\n", command);
+            success = false;
+        }
+    }
+
+    for (struct math_cache_entry_t *entry = cache->missing; entry != NULL; entry = entry->next_missing) {
+        entry->needs_check = true;
+    }
+    cache->missing = NULL;
+    cache->num_missing = 0;
+
+    pthread_mutex_unlock (&cache->lock);
+    mem_pool_destroy (&pool);
+
+    return success;
+}
+
+void math_cache_destroy (struct math_cache_t *cache)
+{
+    pthread_mutex_destroy (&cache->lock);
+    mem_pool_destroy (&cache->pool);
+}
+
+#endif
@@ -0,0 +1,46 @@
+// Fills the math cache of weaver_build, see math_cache.h.
+//
+// Usage:
+//  node math_renderer.js CACHE_DIR
+//
+// Every <key>.tex request in CACHE_DIR is rendered with KaTeX into
+// <key>.html, then the request is removed. The options are the ones the
+// client used, so pre-rendered math looks the same as math typeset in the
+// browser.
+
+const fs = require('fs');
+const path = require('path');
+const katex = require(path.join(__dirname, 'static', 'lib', 'katex', 'katex.min.js'));
+
+if (process.argv.length < 3) {
+    console.log('Usage: node math_renderer.js CACHE_DIR');
+    process.exit(1);
+}
+
+let cache_dir = process.argv[2];
+let num_rendered = 0;
+for (let fname of fs.readdirSync(cache_dir)) {
+    if (!fname.endsWith('.tex')) continue;
+
+    let request_path = path.join(cache_dir, fname);
+    let request = fs.readFileSync(request_path, 'utf8');
+    let line_end = request.indexOf('\n');
+    let mode = request.substring(0, line_end);
+    let tex = request.substring(line_end + 1);
+
+    let html = katex.renderToString(tex, {
+        throwOnError: false,
+        displayMode: mode === 'display'
+    });
+
+    // Write to a temporary file and rename it, so weaver_build never reads a
+    // partially written formula.
+    let key = fname.substring(0, fname.length - '.tex'.length);
+    let tmp_path = path.join(cache_dir, '.' + key + '.html.tmp');
+    fs.writeFileSync(tmp_path, html);
+    fs.renameSync(tmp_path, path.join(cache_dir, key + '.html'));
+    fs.unlinkSync(request_path);
+    num_rendered++;
+}
+
+console.log('Rendered ' + num_rendered + ' formulas');
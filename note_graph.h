@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2021 Santiago León O.
+ */
+
+// Binary note graph index. The graph is stored in compressed sparse row form
+// so it can be memory mapped and queried without deserializing anything,
+// opening an index only validates the header.
+//
+// Layout, all integers are native endian uint32_t:
+//
+//  header
+//  link_offsets[num_notes+1]     Links of note i are links[link_offsets[i]]
+//  links[num_links]              up to links[link_offsets[i+1]].
+//  backlink_offsets[num_notes+1] Same for backlinks.
+//  backlinks[num_links]
+//  orphans[num_orphans]          Notes without backlinks.
+//  ids[num_notes]                Offsets into the string table.
+//  titles[num_notes]
+//  id_index[index_size]          Open addressing tables from the hash of an
+//  title_index[index_size]       id/title to note index + 1, 0 means empty.
+//  strings[strings_size]         NUL terminated, each string is stored once.
+//
+// The index is written to a temporary file and then renamed, processes that
+// have the previous version mapped keep seeing a consistent graph.
+
+#define NOTE_GRAPH_MAGIC "WVGRAPH"
+#define NOTE_GRAPH_VERSION 1
+
+struct note_graph_header_t {
+    char magic[8];
+    uint32_t version;
+
+    uint32_t num_notes;
+    uint32_t num_links;
+    uint32_t num_orphans;
+    uint32_t index_size;
+    uint32_t strings_size;
+};
+
+struct note_graph_t {
+    void *data;
+    size_t size;
+
+    uint32_t num_notes;
+    uint32_t num_links;
+    uint32_t num_orphans;
+    uint32_t index_size;
+
+    uint32_t *link_offsets;
+    uint32_t *links;
+    uint32_t *backlink_offsets;
+    uint32_t *backlinks;
+    uint32_t *orphans;
+    uint32_t *ids;
+    uint32_t *titles;
+    uint32_t *id_index;
+    uint32_t *title_index;
+    char *strings;
+    uint32_t strings_size;
+};
+
+bool note_graph_open (struct note_graph_t *graph, char *path);
+void note_graph_close (struct note_graph_t *graph);
+
+bool note_graph_write (char *path, uint32_t num_notes, char **ids, char **titles,
+                       uint32_t *link_offsets, uint32_t *links);
+
+#if defined(NOTE_GRAPH_IMPL)
+
+#include <sys/mman.h>
+
+static inline
+uint32_t note_graph_index_size (uint32_t num_notes)
+{
+    uint32_t index_size = 16;
+    while (index_size < 2*num_notes) {
+        index_size *= 2;
+    }
+    return index_size;
+}
+
+// Computes pointers into the sections of the index stored at data. Returns
+// false if the sizes in the header don't match the size of the data.
+bool note_graph_init (struct note_graph_t *graph, void *data, size_t size)
+{
+    struct note_graph_header_t *header = (struct note_graph_header_t*)data;
+    if (size < sizeof(struct note_graph_header_t) ||
+        memcmp (header->magic, NOTE_GRAPH_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != NOTE_GRAPH_VERSION) {
+        return false;
+    }
+
+    uint64_t num_words = 2*((uint64_t)header->num_notes + 1) + 2*(uint64_t)header->num_links +
+        header->num_orphans + 2*(uint64_t)header->num_notes + 2*(uint64_t)header->index_size;
+    if (sizeof(struct note_graph_header_t) + num_words*sizeof(uint32_t) + header->strings_size != size) {
+        return false;
+    }
+
+    graph->data = data;
+    graph->size = size;
+    graph->num_notes = header->num_notes;
+    graph->num_links = header->num_links;
+    graph->num_orphans = header->num_orphans;
+    graph->index_size = header->index_size;
+    graph->strings_size = header->strings_size;
+
+    uint32_t *pos = (uint32_t*)(header + 1);
+    graph->link_offsets = pos; pos += graph->num_notes + 1;
+    graph->links = pos; pos += graph->num_links;
+    graph->backlink_offsets = pos; pos += graph->num_notes + 1;
+    graph->backlinks = pos; pos += graph->num_links;
+    graph->orphans = pos; pos += graph->num_orphans;
+    graph->ids = pos; pos += graph->num_notes;
+    graph->titles = pos; pos += graph->num_notes;
+    graph->id_index = pos; pos += graph->index_size;
+    graph->title_index = pos; pos += graph->index_size;
+    graph->strings = (char*)pos;
+
+    return true;
+}
+
+bool note_graph_open (struct note_graph_t *graph, char *path)
+{
+    bool success = true;
+    *graph = ZERO_INIT (struct note_graph_t);
+
+    int fd = open (path, O_RDONLY);
+    if (fd == -1) {
+        printf ("Error opening %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && st.st_size > 0) {
+        data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close (fd);
+
+    if (data == MAP_FAILED) {
+        printf ("Error mapping %s: %s\n", path, strerror(errno));
+        success = false;
+
+    } else if (!note_graph_init (graph, data, st.st_size)) {
+        printf ("Invalid note graph index %s\n", path);
+        munmap (data, st.st_size);
+        success = false;
+    }
+
+    return success;
+}
+
+void note_graph_close (struct note_graph_t *graph)
+{
+    if (graph->data != NULL) {
+        munmap (graph->data, graph->size);
+    }
+    *graph = ZERO_INIT (struct note_graph_t);
+}
+
+static inline
+char* note_graph_id (struct note_graph_t *graph, uint32_t note)
+{
+    return graph->strings + graph->ids[note];
+}
+
+static inline
+char* note_graph_title (struct note_graph_t *graph, uint32_t note)
+{
+    return graph->strings + graph->titles[note];
+}
+
+static inline
+uint32_t* note_graph_links (struct note_graph_t *graph, uint32_t note, uint32_t *count)
+{
+    *count = graph->link_offsets[note+1] - graph->link_offsets[note];
+    return graph->links + graph->link_offsets[note];
+}
+
+static inline
+uint32_t* note_graph_backlinks (struct note_graph_t *graph, uint32_t note, uint32_t *count)
+{
+    *count = graph->backlink_offsets[note+1] - graph->backlink_offsets[note];
+    return graph->backlinks + graph->backlink_offsets[note];
+}
+
+static inline
+uint32_t* note_graph_orphans (struct note_graph_t *graph, uint32_t *count)
+{
+    *count = graph->num_orphans;
+    return graph->orphans;
+}
+
+int note_graph_index_lookup (struct note_graph_t *graph, uint32_t *index, uint32_t *strings, char *key)
+{
+    uint32_t mask = graph->index_size - 1;
+    uint32_t i = fnv1a_64_str (key) & mask;
+    while (index[i] != 0) {
+        uint32_t note = index[i] - 1;
+        if (strcmp (graph->strings + strings[note], key) == 0) {
+            return note;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return -1;
+}
+
+// Return the index of the note with the passed id or title, -1 if it's not in
+// the graph.
+#define note_graph_find_id(graph,id) note_graph_index_lookup(graph,(graph)->id_index,(graph)->ids,id)
+#define note_graph_find_title(graph,title) note_graph_index_lookup(graph,(graph)->title_index,(graph)->titles,title)
+
+void note_graph_index_add (uint32_t *index, uint32_t index_size, char *strings, uint32_t *offsets, uint32_t note)
+{
+    char *key = strings + offsets[note];
+    uint32_t mask = index_size - 1;
+    uint32_t i = fnv1a_64_str (key) & mask;
+    while (index[i] != 0) {
+        // Keep the first note with a repeated key.
+        if (strcmp (strings + offsets[index[i] - 1], key) == 0) return;
+        i = (i + 1) & mask;
+    }
+
+    index[i] = note + 1;
+}
+
+// Interns str into the string table being built in strings. Keys of the map
+// from string to offset point to the caller's strings, they aren't copied.
+HASH_MAP_NEW (note_graph_string, char*, uint32_t, fnv1a_64_str(key), strcmp(a, b) == 0, key)
+
+uint32_t note_graph_intern (struct note_graph_string_map_t *interned, string_t *strings, char *str)
+{
+    uint32_t offset;
+    if (!note_graph_string_map_maybe_get (interned, str, &offset)) {
+        offset = str_len (strings);
+        strn_cat_c (strings, str, strlen(str) + 1);
+        note_graph_string_map_insert (interned, str, offset);
+    }
+
+    return offset;
+}
+
+// Links of note i are links[link_offsets[i]] up to links[link_offsets[i+1]],
+// backlinks and orphans are computed here.
+bool note_graph_write (char *path, uint32_t num_notes, char **ids, char **titles,
+                       uint32_t *link_offsets, uint32_t *links)
+{
+    bool success = true;
+    mem_pool_t pool = {0};
+
+    uint32_t num_links = link_offsets[num_notes];
+    uint32_t index_size = note_graph_index_size (num_notes);
+
+    // Backlinks are computed by transposing links with a counting sort, this
+    // keeps backlinks of each note in the order of their source notes.
+    uint32_t *backlink_offsets = mem_pool_push_array (&pool, num_notes + 1, uint32_t);
+    uint32_t *backlinks = mem_pool_push_array (&pool, num_links, uint32_t);
+    memset (backlink_offsets, 0, (num_notes + 1)*sizeof(uint32_t));
+    for (uint32_t i=0; i<num_links; i++) {
+        backlink_offsets[links[i] + 1]++;
+    }
+    for (uint32_t i=0; i<num_notes; i++) {
+        backlink_offsets[i+1] += backlink_offsets[i];
+    }
+
+    uint32_t *fill = mem_pool_push_array (&pool, num_notes, uint32_t);
+    memcpy (fill, backlink_offsets, num_notes*sizeof(uint32_t));
+    for (uint32_t src=0; src<num_notes; src++) {
+        for (uint32_t i=link_offsets[src]; i<link_offsets[src+1]; i++) {
+            backlinks[fill[links[i]]++] = src;
+        }
+    }
+
+    uint32_t num_orphans = 0;
+    uint32_t *orphans = mem_pool_push_array (&pool, num_notes, uint32_t);
+    for (uint32_t i=0; i<num_notes; i++) {
+        if (backlink_offsets[i] == backlink_offsets[i+1]) {
+            orphans[num_orphans++] = i;
+        }
+    }
+
+    string_t strings = {0};
+    struct note_graph_string_map_t interned = {0};
+    interned.pool = &pool;
+    uint32_t *id_offsets = mem_pool_push_array (&pool, num_notes, uint32_t);
+    uint32_t *title_offsets = mem_pool_push_array (&pool, num_notes, uint32_t);
+    for (uint32_t i=0; i<num_notes; i++) {
+        id_offsets[i] = note_graph_intern (&interned, &strings, ids[i]);
+        title_offsets[i] = note_graph_intern (&interned, &strings, titles[i]);
+    }
+
+    uint32_t *id_index = mem_pool_push_array (&pool, index_size, uint32_t);
+    uint32_t *title_index = mem_pool_push_array (&pool, index_size, uint32_t);
+    memset (id_index, 0, index_size*sizeof(uint32_t));
+    memset (title_index, 0, index_size*sizeof(uint32_t));
+    for (uint32_t i=0; i<num_notes; i++) {
+        note_graph_index_add (id_index, index_size, str_data(&strings), id_offsets, i);
+        note_graph_index_add (title_index, index_size, str_data(&strings), title_offsets, i);
+    }
+
+    struct note_graph_header_t header = {0};
+    memcpy (header.magic, NOTE_GRAPH_MAGIC, sizeof(header.magic));
+    header.version = NOTE_GRAPH_VERSION;
+    header.num_notes = num_notes;
+    header.num_links = num_links;
+    header.num_orphans = num_orphans;
+    header.index_size = index_size;
+    header.strings_size = str_len(&strings);
+
+    char *tmp_path = pprintf (&pool, "%s.tmp", path);
+    FILE *file = fopen (tmp_path, "wb");
+    if (file != NULL) {
+        fwrite (&header, sizeof(header), 1, file);
+        fwrite (link_offsets, sizeof(uint32_t), num_notes + 1, file);
+        fwrite (links, sizeof(uint32_t), num_links, file);
+        fwrite (backlink_offsets, sizeof(uint32_t), num_notes + 1, file);
+        fwrite (backlinks, sizeof(uint32_t), num_links, file);
+        fwrite (orphans, sizeof(uint32_t), num_orphans, file);
+        fwrite (id_offsets, sizeof(uint32_t), num_notes, file);
+        fwrite (title_offsets, sizeof(uint32_t), num_notes, file);
+        fwrite (id_index, sizeof(uint32_t), index_size, file);
+        fwrite (title_index, sizeof(uint32_t), index_size, file);
+        fwrite (str_data(&strings), 1, str_len(&strings), file);
+
+        if (ferror (file)) {
+            printf ("Error writing %s\n", tmp_path);
+            success = false;
+        }
+
+        if (fclose (file) != 0) {
+            success = false;
+        }
+
+        if (success && rename (tmp_path, path) == -1) {
+            printf ("Error writing %s: %s\n", path, strerror(errno));
+            success = false;
+        }
+
+    } else {
+        printf ("Error opening %s: %s\n", tmp_path, strerror(errno));
+        success = false;
+    }
+
+    str_free (&strings);
+    mem_pool_destroy (&pool);
+
+    return success;
+}
+
+#endif
@@ -136,9 +136,23 @@ def sort_title_notes ():
 
 def generate ():
     title_notes = store_get ('title_notes', [])
-    note_title_to_id, id_to_note_title = gn.get_note_maps(source_notes_dir)
-
-    root_notes, note_links, note_backlinks = gn.get_note_graph(source_notes_dir, note_title_to_id, ["note", "summary"])
+    # Pre-render all notes into HTML fragments placed next to the copied raw
+    # notes. Links are collected while parsing, so this also computes the note
+    # graph. Math is rendered with KaTeX by math_renderer.js, and cached so
+    # formulas are only rendered once.
+    out_notes_dir = path_cat(out_dir, notes_dir)
+    note_graph_path = path_cat(cache_dir, 'note_graph.json')
+    note_graph_index_path = path_cat(cache_dir, 'note_graph.idx')
+    math_cache_dir = path_cat(cache_dir, 'math')
+    weaver_build()
+    ex (f'./bin/weaver_build --graph {note_graph_path} --index {note_graph_index_path} --math-cache {math_cache_dir} --math-renderer "node math_renderer.js" {source_notes_dir} {out_notes_dir}')
+
+    note_graph = json_load(note_graph_path)
+    root_notes = note_graph['root_notes']
+    note_links = note_graph['note_links']
+    note_backlinks = note_graph['note_backlinks']
+    note_title_to_id = note_graph['note_title_to_id']
+    id_to_note_title = note_graph['id_to_note_title']
 
     orphan_notes = [n for n in root_notes if n not in title_notes]
     if len (orphan_notes) > 0:
@@ -164,7 +178,7 @@ def generate ():
 
     gn.copy_changed(static_dir, out_dir)
     gn.copy_changed(source_files_dir, path_cat(out_dir, files_dir))
-    gn.copy_changed(source_notes_dir, path_cat(out_dir, notes_dir))
+    gn.copy_changed(source_notes_dir, out_notes_dir)
 
 ensure_dir ("bin")
 modes = {
@@ -176,7 +190,19 @@ mode = store('mode', get_cli_arg_opt('-M,--mode', modes.keys()), 'debug')
 C_FLAGS = modes[mode]
 
 def markup_parser_tests():
-    ex (f'gcc {C_FLAGS} -o bin/markup_parser_tests markup_parser_tests.c -lm')
+    ex (f'gcc {C_FLAGS} -o bin/markup_parser_tests markup_parser_tests.c -lm -lpthread')
+
+def markup_parser_bench():
+    ex (f'gcc {C_FLAGS} -o bin/markup_parser_bench markup_parser_bench.c -lm -lpthread')
+
+def weaver_build():
+    ex (f'gcc {C_FLAGS} -o bin/weaver_build weaver_build.c -lm -lpthread')
+
+def weaver_graph():
+    ex (f'gcc {C_FLAGS} -o bin/weaver_graph weaver_graph.c -lm')
+
+def regexp_bench():
+    ex (f'gcc {C_FLAGS} -o bin/regexp_bench regexp_bench.c -lm')
 
 if __name__ == "__main__":
     # Everything above this line will be executed for each TAB press.
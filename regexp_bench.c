@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2021 Santiago León O.
+ */
+
+#include <time.h>
+
+#include "common.h"
+#include "lib/regexp.h"
+#include "lib/regexp.c"
+
+// Compares the backtracking matcher with the linear time one (REG_LINEAR) on
+// inputs that are adversarial for backtracking. Backtracking time grows
+// exponentially or polynomially with the length of the input, linear time
+// stays proportional to it.
+
+double time_now ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// Returns the average time in milliseconds of a regexec() call.
+double bench_regexec (char *pattern, int flags, char *str)
+{
+    const char *error;
+    Reprog *regex = regcomp (pattern, flags, &error);
+    if (regex == NULL) {
+        printf ("Failed to compile %s: %s\n", pattern, error);
+        return NAN;
+    }
+
+    int repetitions = 0;
+    double start = time_now ();
+    double elapsed;
+    do {
+        Resub m;
+        regexec (regex, str, &m, 0);
+        repetitions++;
+        elapsed = time_now () - start;
+    } while (elapsed < 0.05);
+
+    regfree (regex);
+
+    return 1000*elapsed/repetitions;
+}
+
+void bench_pattern (char *name, char *pattern, char *prefix, char *repeated, char *suffix,
+                    int max_backtracking_len, int max_len)
+{
+    printf ("%s: %s\n", name, pattern);
+    printf ("%8s %16s %16s\n", "length", "backtrack (ms)", "linear (ms)");
+
+    string_t str = {0};
+    for (int n=4; n<=max_len; n*=2) {
+        str_set (&str, prefix);
+        for (int i=0; i<n; i++) str_cat_c (&str, repeated);
+        str_cat_c (&str, suffix);
+
+        printf ("%8d ", str_len(&str));
+        if (n <= max_backtracking_len) {
+            printf ("%16.4f ", bench_regexec (pattern, 0, str_data(&str)));
+        } else {
+            printf ("%16s ", "-");
+        }
+        printf ("%16.4f\n", bench_regexec (pattern, REG_LINEAR, str_data(&str)));
+    }
+    printf ("\n");
+
+    str_free (&str);
+}
+
+// Searches a note sized text where only the last line matches.
+void bench_search (char *name, char *pattern, int flags)
+{
+    string_t str = {0};
+    for (int i=0; i<20000; i++) {
+        str_cat_printf (&str, "Line %d of a paragraph with some \\b{bold} text and a \\note{Title}.\n", i);
+    }
+    str_cat_c (&str, "https://youtu.be/Rpjab--XQ0U \\link{http://example.com}\n");
+
+    printf ("%s: %s\n", name, pattern);
+    printf ("%d bytes in %.4f ms\n\n", str_len(&str), bench_regexec (pattern, flags, str_data(&str)));
+
+    str_free (&str);
+}
+
+int main (int argc, char **argv)
+{
+    bench_pattern ("Nested quantifiers", "(a+)+b", "b", "a", "", 16, 4096);
+
+    bench_pattern ("YouTube URL", "^.*(youtu.be\\/|youtube(-nocookie)?.com\\/(v\\/|.*u\\/\\w\\/|embed\\/|.*v=))([\\w-]{11}).*",
+                   "https://www.", "youtube.com/u/x/", "", 512, 4096);
+
+    bench_search ("Literal prefix", "\\\\link\\{([^}]*)\\}", 0);
+    bench_search ("Literal prefix, linear", "\\\\link\\{([^}]*)\\}", REG_LINEAR);
+    bench_search ("Byte set", "[xyz]+[0-9]", 0);
+    bench_search ("Required literal", "\\w+\\.be/", 0);
+
+    return 0;
+}
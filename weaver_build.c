@@ -0,0 +1,1086 @@
+/*
+ * Copyright (C) 2021 Santiago León O.
+ */
+
+#include <pthread.h>
+
+#include "common.h"
+#include "binary_tree.c"
+
+#define MARKUP_PARSER_IMPL
+#include "markup_parser.h"
+
+#define NOTE_GRAPH_IMPL
+#include "note_graph.h"
+
+#define FILE_LOADER_IMPL
+#include "file_loader.h"
+
+#define MATH_CACHE_IMPL
+#include "math_cache.h"
+
+// Offline renderer for a whole notes directory. Every note is parsed with
+// markup_to_html() and the resulting HTML fragment is written to the output
+// directory as <note id>.html, so the browser doesn't need to parse notes on
+// every page open.
+//
+// Usage:
+//  weaver_build [-j NUM_THREADS] [--force] [--graph GRAPH_FILE] [--index INDEX_FILE]
+//               [--math-cache MATH_DIR [--math-renderer COMMAND]] NOTES_DIR [OUT_DIR]
+//
+// When OUT_DIR is not passed, fragments are written next to the raw notes in
+// NOTES_DIR. Notes are distributed across NUM_THREADS worker threads, by
+// default one for each online CPU. Notes are read in the background by a
+// file_loader_t and then go through a pipeline that parses, renders and
+// writes them, described in run_jobs().
+//
+// Builds are incremental. A manifest stored in OUT_DIR keeps, for each note,
+// the hash of its content, the hash of the rendered fragment and the titles it
+// links to. Only notes whose content changed are rendered again, plus notes
+// linking to a title that was added, removed or renamed. Notes whose size and
+// modification time didn't change aren't even read. Use --force to render all
+// notes, for example after changing the parser.
+//
+// \summary{} tags include the first paragraph of the target note, so notes
+// using them are also rendered again when the content of the target changes.
+//
+// If MATH_DIR is passed, \math{} and \Math{} tags are rendered using the math
+// cache stored there, described in math_cache.h. Formulas missing from the
+// cache are requested after rendering all notes, then COMMAND is run to
+// render them, usually "node math_renderer.js", and notes that used them are
+// rendered again. Notes with missing math are also rendered in the next
+// build, in case COMMAND failed or wasn't passed. The manifest records if the
+// math cache was used, notes containing math are rendered again when a build
+// adds or drops --math-cache.
+//
+// If GRAPH_FILE is passed, the note graph is written there as a JSON object
+// with note_links and note_backlinks, mapping a note id to the ids it links
+// to or is linked from, root_notes, the ids of notes without backlinks, and
+// the note_title_to_id and id_to_note_title maps.
+// If INDEX_FILE is passed, the same graph is written in the binary format
+// described in note_graph.h, which can be queried with weaver_graph.
+
+#define MANIFEST_FNAME ".manifest"
+#define MANIFEST_HEADER "weaver-manifest 4"
+
+struct note_t {
+    char *path;
+    char *id;
+
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+
+    char *title;
+    uint64_t content_hash;
+    uint64_t output_hash;
+
+    struct psx_link_t *links;
+    struct psx_link_t *links_end;
+
+    // The note has \math{} or \Math{} tags. Some of them may have been
+    // rendered as TeX because they weren't in the math cache.
+    bool has_math;
+    bool missing_math;
+
+    // Manifest entry from the previous build, NULL for new notes.
+    struct note_t *old;
+    bool seen;
+
+    bool rendered;
+
+    // Note graph, resolved after all notes are processed.
+    struct note_ref_t *out_links;
+    struct note_ref_t *out_links_end;
+    struct note_ref_t *backlinks;
+    struct note_ref_t *backlinks_end;
+    struct note_t *link_mark;
+    uint32_t graph_idx;
+
+    struct note_t *next;
+};
+
+struct note_ref_t {
+    struct note_t *note;
+    struct note_ref_t *next;
+};
+
+CSTR_HASH_MAP_NEW (note, struct note_t*)
+CSTR_HASH_MAP_NEW (title_set, bool)
+
+// Bounded lock-free queue connecting stages of the pipeline, any number of
+// threads can push and pop concurrently. This is Dmitry Vyukov's bounded
+// MPMC queue, the sequence number of a cell tells if it's ready to be
+// written or read in the current lap around the ring.
+struct job_queue_cell_t {
+    size_t sequence;
+    struct build_job_t *job;
+};
+
+struct job_queue_t {
+    struct job_queue_cell_t *cells;
+    size_t mask;
+
+    size_t head;
+    size_t tail;
+};
+
+// size must be a power of 2.
+void job_queue_init (mem_pool_t *pool, struct job_queue_t *queue, size_t size)
+{
+    queue->cells = mem_pool_push_array (pool, size, struct job_queue_cell_t);
+    for (size_t i=0; i<size; i++) {
+        queue->cells[i].sequence = i;
+        queue->cells[i].job = NULL;
+    }
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+// Returns false if the queue is full.
+bool job_queue_push (struct job_queue_t *queue, struct build_job_t *job)
+{
+    size_t pos = __atomic_load_n (&queue->tail, __ATOMIC_RELAXED);
+    while (true) {
+        struct job_queue_cell_t *cell = &queue->cells[pos & queue->mask];
+        intptr_t diff = (intptr_t)__atomic_load_n (&cell->sequence, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n (&queue->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->job = job;
+                __atomic_store_n (&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+
+        } else if (diff < 0) {
+            return false;
+
+        } else {
+            pos = __atomic_load_n (&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Returns NULL if the queue is empty.
+struct build_job_t* job_queue_pop (struct job_queue_t *queue)
+{
+    size_t pos = __atomic_load_n (&queue->head, __ATOMIC_RELAXED);
+    while (true) {
+        struct job_queue_cell_t *cell = &queue->cells[pos & queue->mask];
+        intptr_t diff = (intptr_t)__atomic_load_n (&cell->sequence, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n (&queue->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                struct build_job_t *job = cell->job;
+                __atomic_store_n (&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+                return job;
+            }
+
+        } else if (diff < 0) {
+            return NULL;
+
+        } else {
+            pos = __atomic_load_n (&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+struct weaver_build_t {
+    mem_pool_t pool;
+
+    char *out_dir;
+    char *graph_path;
+    char *index_path;
+    char *math_dir;
+    char *math_renderer;
+    int num_threads;
+    bool force;
+
+    int num_notes;
+    struct note_t *notes;
+    struct note_t *notes_end;
+
+    struct note_map_t manifest;
+    struct note_map_t title_to_note;
+
+    // Notes that \summary{} tags can expand in the current phase, see
+    // summary_notes_build().
+    struct note_map_t summary_notes;
+    struct psx_note_source_t note_source;
+
+    struct math_cache_t math_cache;
+    struct psx_math_source_t math_source;
+
+    // The previous build used a math cache, if it differs from the current
+    // one math in the old fragments was rendered differently.
+    bool old_math_cache;
+    bool math_cache_changed;
+
+    struct note_t *old_notes;
+    struct note_t *old_notes_end;
+
+    // Notes that need to be processed by the workers in the current phase,
+    // they enter the pipeline in the order the loader reads them.
+    struct note_t **jobs;
+    int num_jobs;
+    int num_done;
+    bool jobs_render;
+
+    struct file_loader_t loader;
+    struct job_queue_t free_jobs;
+    struct job_queue_t parsed_jobs;
+    struct job_queue_t rendered_jobs;
+};
+
+// A note going through the pipeline. Each job owns an arena where the block
+// tree and HTML of the note are allocated, it's reset when the note leaves
+// the pipeline. Its first bin is kept allocated across notes, so in the
+// common case rendering a note doesn't call malloc() for the tree, only for
+// strings that don't fit the small string optimization. Data that must
+// outlive the rendering, like the title and links of the note, is allocated
+// in the pool of the worker that computed it instead.
+#define JOB_ARENA_SIZE megabyte(1)
+#define PIPELINE_JOBS_PER_WORKER 2
+
+struct build_job_t {
+    struct note_t *note;
+    struct file_load_t *file;
+
+    mem_pool_t arena;
+    mem_pool_marker_t arena_start;
+
+    struct psx_block_t *root;
+    struct html_t *html;
+};
+
+struct build_worker_t {
+    pthread_t thread;
+    struct weaver_build_t *wb;
+
+    mem_pool_t pool;
+
+    int num_rendered;
+    int num_failed;
+};
+
+ITERATE_DIR_CB (collect_note)
+{
+    struct weaver_build_t *wb = (struct weaver_build_t*)data;
+
+    if (!is_dir) {
+        // Skip previously generated fragments, in case they are being written
+        // in the same directory as the notes.
+        char *extension = get_extension (fname);
+        if (extension != NULL && strcmp (extension, "html") == 0) {
+            return;
+        }
+
+        struct stat st;
+        if (stat (fname, &st) == 0) {
+            LINKED_LIST_APPEND_NEW (&wb->pool, struct note_t, wb->notes, new_note);
+            new_note->path = pom_strdup (&wb->pool, fname);
+            path_split (&wb->pool, new_note->path, NULL, &new_note->id);
+            new_note->size = st.st_size;
+            new_note->mtime_sec = st.st_mtim.tv_sec;
+            new_note->mtime_nsec = st.st_mtim.tv_nsec;
+            wb->num_notes++;
+        }
+    }
+}
+
+void note_link_add (mem_pool_t *pool, struct note_t *note, char *target, bool is_summary)
+{
+    LINKED_LIST_APPEND_NEW (pool, struct psx_link_t, note->links, new_link);
+    new_link->target = target;
+    new_link->is_summary = is_summary;
+}
+
+// Titles of notes that changed are only known after they are parsed, so
+// summaries are expanded in the second phase, while the map is empty they are
+// rendered as links. The map is only read while workers run, so it's safe to
+// share between them.
+void summary_notes_build (struct weaver_build_t *wb)
+{
+    LINKED_LIST_FOR (struct note_t*, note, wb->notes) {
+        if (note->title != NULL) {
+            note_map_insert (&wb->summary_notes, note->title, note);
+        }
+    }
+}
+
+PSX_GET_MATH_CB (math_cache_get_math)
+{
+    return math_cache_get ((struct math_cache_t*)data, tex, display_mode);
+}
+
+PSX_GET_NOTE_CB (summary_get_note)
+{
+    struct weaver_build_t *wb = (struct weaver_build_t*)data;
+
+    struct note_t *note = note_map_get (&wb->summary_notes, title);
+    if (note == NULL) return NULL;
+
+    return full_file_map (pool, note->path, NULL);
+}
+
+// The title is the content of the heading in the first line of the note.
+char* note_title (mem_pool_t *pool, char *markup)
+{
+    char *pos = markup;
+    while (*pos == '#') pos++;
+    while (is_space(pos)) pos++;
+
+    char *end = pos;
+    while (*end != '\n' && *end != '\0') end++;
+    while (end > pos && is_space(end - 1)) end--;
+
+    return pom_strndup (pool, pos, end - pos);
+}
+
+struct fragment_writer_t {
+    int fd;
+    uint64_t hash;
+};
+
+HTML_WRITE_CB (fragment_write_cb)
+{
+    struct fragment_writer_t *fw = (struct fragment_writer_t*)data;
+    fw->hash = fnv1a_64_update (fw->hash, buffer, len);
+    return html_write_fd_cb (&fw->fd, buffer, len);
+}
+
+// Stream the fragment of note id into a hidden temporary file while hashing
+// it. The fragment is only replaced if its hash differs from old_hash or it
+// doesn't exist, so unchanged fragments keep their modification time.
+bool fragment_write (mem_pool_t *pool, struct html_t *html, char *out_dir, char *id,
+                     uint64_t *hash, uint64_t *old_hash)
+{
+    bool success = true;
+
+    char *path = pprintf (pool, "%s/%s.html", out_dir, id);
+    char *tmp_path = pprintf (pool, "%s/.%s.html.tmp", out_dir, id);
+
+    struct fragment_writer_t fw = {0};
+    fw.hash = FNV1A_64_OFFSET_BASIS;
+    fw.fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fw.fd != -1) {
+        success = html_write_cb (html, 2, fragment_write_cb, &fw);
+        if (close (fw.fd) == -1) success = false;
+
+        if (!success) {
+            printf ("Error writing %s: %s\n", tmp_path, strerror(errno));
+            unlink (tmp_path);
+
+        } else if (old_hash != NULL && *old_hash == fw.hash && path_exists (path)) {
+            unlink (tmp_path);
+
+        } else if (rename (tmp_path, path) == -1) {
+            printf ("Error writing %s: %s\n", path, strerror(errno));
+            unlink (tmp_path);
+            success = false;
+        }
+
+    } else {
+        printf ("Error opening %s: %s\n", tmp_path, strerror(errno));
+        success = false;
+    }
+
+    *hash = fw.hash;
+
+    return success;
+}
+
+// The math in the fragment of a note from the previous build may render
+// differently now, because the math cache was added or removed, or because
+// some of it was missing from the cache.
+bool note_math_outdated (struct weaver_build_t *wb, struct note_t *old)
+{
+    return old->has_math &&
+        (wb->math_cache_changed || (old->missing_math && wb->math_dir != NULL));
+}
+
+// Stage 1: Parse the block tree of a note the loader finished reading.
+// Returns false if the note doesn't need to go through the rest of the
+// pipeline, because it couldn't be read or its content didn't change.
+bool build_job_parse (struct build_worker_t *worker, struct build_job_t *job, bool force)
+{
+    struct note_t *note = job->note;
+    char *markup = job->file->content;
+
+    if (markup == NULL) {
+        worker->num_failed++;
+        return false;
+    }
+
+    note->content_hash = fnv1a_64 (markup, job->file->len);
+    if (!force && note->old != NULL && note->old->content_hash == note->content_hash &&
+        !note_math_outdated (worker->wb, note->old)) {
+        // Only the modification time changed, reuse the previous results.
+        note->title = note->old->title;
+        note->links = note->old->links;
+        note->output_hash = note->old->output_hash;
+        note->has_math = note->old->has_math;
+        note->missing_math = note->old->missing_math;
+        return false;
+    }
+
+    note->title = note_title (&worker->pool, markup);
+    job->root = parse_note_text (&job->arena, markup);
+
+    return true;
+}
+
+// Stage 2: Render the block tree into HTML, including inline content. After
+// this the HTML doesn't reference the markup anymore, so the file's mapping is
+// released for the loader to read the next note.
+void build_job_render (struct build_worker_t *worker, struct build_job_t *job)
+{
+    struct note_t *note = job->note;
+
+    struct psx_note_links_t note_links = {0};
+    note_links.pool = &worker->pool;
+    job->html = note_html_new (&job->arena, note->id, 0);
+    block_tree_to_html (job->html, job->root, job->html->root, &note_links);
+    note->links = note_links.links;
+    note->links_end = note_links.links_end;
+    note->has_math = note_links.num_math > 0;
+    note->missing_math = note_links.num_missing_math > 0;
+
+    file_loader_release (&worker->wb->loader, job->file);
+    job->file = NULL;
+}
+
+// Stage 3: Serialize the HTML into the note's fragment.
+void build_job_write (struct build_worker_t *worker, struct build_job_t *job)
+{
+    struct note_t *note = job->note;
+
+    // Notes with summaries can be rendered in both phases, the second time
+    // the fragment written in the first one is what's on disk.
+    uint64_t old_hash;
+    uint64_t *old_hash_ptr = NULL;
+    if (note->rendered) {
+        old_hash = note->output_hash;
+        old_hash_ptr = &old_hash;
+    } else if (note->old != NULL) {
+        old_hash_ptr = &note->old->output_hash;
+    }
+
+    if (fragment_write (&job->arena, job->html, worker->wb->out_dir, note->id, &note->output_hash, old_hash_ptr)) {
+        if (!note->rendered) worker->num_rendered++;
+    } else {
+        worker->num_failed++;
+    }
+    note->rendered = true;
+}
+
+void build_job_finish (struct weaver_build_t *wb, struct build_job_t *job)
+{
+    if (job->file != NULL) {
+        file_loader_release (&wb->loader, job->file);
+        job->file = NULL;
+    }
+
+    mem_pool_end_temporary_memory (job->arena_start);
+    job->arena_start = mem_pool_begin_temporary_memory (&job->arena);
+
+    __atomic_fetch_add (&wb->num_done, 1, __ATOMIC_RELEASE);
+    job_queue_push (&wb->free_jobs, job);
+}
+
+void* build_worker_thread (void *data)
+{
+    struct build_worker_t *worker = (struct build_worker_t*)data;
+    struct weaver_build_t *wb = worker->wb;
+    bool force = wb->force || wb->jobs_render;
+
+    // Prefer jobs in the latest stages, so notes already in the pipeline are
+    // finished before new ones are read.
+    while (__atomic_load_n (&wb->num_done, __ATOMIC_ACQUIRE) < wb->num_jobs) {
+        struct build_job_t *job;
+        if ((job = job_queue_pop (&wb->rendered_jobs)) != NULL) {
+            build_job_write (worker, job);
+            build_job_finish (wb, job);
+
+        } else if ((job = job_queue_pop (&wb->parsed_jobs)) != NULL) {
+            build_job_render (worker, job);
+            job_queue_push (&wb->rendered_jobs, job);
+
+        } else if ((job = job_queue_pop (&wb->free_jobs)) != NULL) {
+            job->file = file_loader_next (&wb->loader);
+            if (job->file == NULL) {
+                // All notes were read, wait for the ones in the pipeline.
+                job_queue_push (&wb->free_jobs, job);
+                sched_yield ();
+
+            } else {
+                job->note = (struct note_t*)job->file->data;
+                if (build_job_parse (worker, job, force)) {
+                    job_queue_push (&wb->parsed_jobs, job);
+                } else {
+                    build_job_finish (wb, job);
+                }
+            }
+
+        } else {
+            sched_yield ();
+        }
+    }
+
+    return NULL;
+}
+
+// Process all jobs in wb->jobs using up to wb->num_threads workers.
+//
+// Notes are processed by a pipeline with 4 stages: the loader reads them,
+// then they are parsed, rendered and written by the stage functions above.
+// Stages are connected by queues of build_job_t, and there are only
+// PIPELINE_JOBS_PER_WORKER jobs for each worker, so reading, parsing and
+// writing overlap while memory usage doesn't depend on the number of notes.
+// Workers aren't bound to a stage, each one runs whatever stage has a job
+// waiting. Queues are as large as the number of jobs, so pushing to them
+// never fails.
+//
+// Titles and links of rendered notes are allocated in the workers' pools,
+// these are kept alive as children of the main pool until the manifest is
+// written.
+void run_jobs (struct weaver_build_t *wb, int *num_rendered, int *num_failed)
+{
+    if (wb->num_jobs == 0) return;
+
+    mem_pool_t pool = {0};
+
+    int num_threads = MIN (wb->num_threads, wb->num_jobs);
+    struct build_worker_t *new_workers = mem_pool_push_array (&wb->pool, num_threads, struct build_worker_t);
+
+    // Keep enough notes loaded so workers don't wait for reads, but not the
+    // whole directory.
+    wb->loader = ZERO_INIT (struct file_loader_t);
+    wb->loader.max_buffers = MAX (FILE_LOADER_QUEUE_DEPTH, PIPELINE_JOBS_PER_WORKER*num_threads);
+    for (int i=0; i<wb->num_jobs; i++) {
+        file_loader_add (&wb->loader, wb->jobs[i]->path, wb->jobs[i]);
+    }
+    file_loader_start (&wb->loader);
+
+    int num_pipeline_jobs = MIN (PIPELINE_JOBS_PER_WORKER*num_threads, wb->num_jobs);
+    size_t queue_size = 1;
+    while (queue_size < num_pipeline_jobs) queue_size *= 2;
+    job_queue_init (&pool, &wb->free_jobs, queue_size);
+    job_queue_init (&pool, &wb->parsed_jobs, queue_size);
+    job_queue_init (&pool, &wb->rendered_jobs, queue_size);
+
+    struct build_job_t *jobs = mem_pool_push_array (&pool, num_pipeline_jobs, struct build_job_t);
+    for (int i=0; i<num_pipeline_jobs; i++) {
+        jobs[i] = ZERO_INIT (struct build_job_t);
+
+        // Allocate the first bin of the arena before taking the marker,
+        // otherwise ending the temporary memory would destroy the whole pool.
+        jobs[i].arena.min_bin_size = JOB_ARENA_SIZE;
+        mem_pool_push_size (&jobs[i].arena, sizeof(void*));
+        jobs[i].arena_start = mem_pool_begin_temporary_memory (&jobs[i].arena);
+
+        job_queue_push (&wb->free_jobs, &jobs[i]);
+    }
+
+    wb->num_done = 0;
+    for (int i=0; i<num_threads; i++) {
+        new_workers[i] = ZERO_INIT (struct build_worker_t);
+        new_workers[i].wb = wb;
+        pthread_create (&new_workers[i].thread, NULL, build_worker_thread, &new_workers[i]);
+    }
+
+    for (int i=0; i<num_threads; i++) {
+        pthread_join (new_workers[i].thread, NULL);
+        *num_rendered += new_workers[i].num_rendered;
+        *num_failed += new_workers[i].num_failed;
+
+        // Store the worker's pool in the main pool, it will be destroyed
+        // along with it.
+        mem_pool_t *worker_pool = mem_pool_push_struct (&wb->pool, mem_pool_t);
+        *worker_pool = new_workers[i].pool;
+        mem_pool_add_child (&wb->pool, worker_pool);
+    }
+
+    for (int i=0; i<num_pipeline_jobs; i++) {
+        mem_pool_destroy (&jobs[i].arena);
+    }
+    file_loader_destroy (&wb->loader);
+    mem_pool_destroy (&pool);
+}
+
+void manifest_load (struct weaver_build_t *wb, char *path)
+{
+    mem_pool_t *pool = &wb->pool;
+
+    if (!path_exists (path)) return;
+
+    char *data = full_file_read (pool, path, NULL);
+    if (data == NULL) return;
+
+    char *line = data;
+    char *next_line = NULL;
+    for (; line != NULL && *line != '\0'; line = next_line) {
+        char *end = strchr (line, '\n');
+        next_line = NULL;
+        if (end != NULL) {
+            *end = '\0';
+            next_line = end + 1;
+        }
+
+        if (line == data) {
+            if (strcmp (line, MANIFEST_HEADER) != 0) {
+                printf ("Ignoring manifest with unknown format %s\n", path);
+                break;
+            }
+
+        } else if (strncmp (line, "note ", 5) == 0) {
+            char id[256];
+            int title_start = 0;
+            LINKED_LIST_APPEND_NEW (pool, struct note_t, wb->old_notes, old_note);
+            int matched = sscanf (line, "note %255s %" SCNu64 " %" SCNd64 " %" SCNd64 " %" SCNx64 " %" SCNx64 " %n",
+                                  id, &old_note->size, &old_note->mtime_sec, &old_note->mtime_nsec,
+                                  &old_note->content_hash, &old_note->output_hash, &title_start);
+            if (matched < 6) {
+                printf ("Invalid manifest entry: %s\n", line);
+                break;
+            }
+
+            old_note->id = pom_strdup (pool, id);
+            old_note->title = pom_strdup (pool, line + title_start);
+            note_map_insert (&wb->manifest, old_note->id, old_note);
+
+        } else if (strncmp (line, "link ", 5) == 0 && wb->old_notes_end != NULL) {
+            note_link_add (pool, wb->old_notes_end, pom_strdup (pool, line + 5), false);
+
+        } else if (strncmp (line, "summary ", 8) == 0 && wb->old_notes_end != NULL) {
+            note_link_add (pool, wb->old_notes_end, pom_strdup (pool, line + 8), true);
+
+        } else if (strcmp (line, "math-cache") == 0 && wb->old_notes == NULL) {
+            wb->old_math_cache = true;
+
+        } else if (strcmp (line, "has-math") == 0 && wb->old_notes_end != NULL) {
+            wb->old_notes_end->has_math = true;
+
+        } else if (strcmp (line, "missing-math") == 0 && wb->old_notes_end != NULL) {
+            wb->old_notes_end->missing_math = true;
+        }
+    }
+}
+
+void manifest_write (struct weaver_build_t *wb, char *path)
+{
+    string_t str = {0};
+    str_cat_printf (&str, MANIFEST_HEADER "\n");
+    if (wb->math_dir != NULL) {
+        str_cat_c (&str, "math-cache\n");
+    }
+
+    LINKED_LIST_FOR (struct note_t*, note, wb->notes) {
+        if (note->title == NULL) continue; // Failed to build
+
+        str_cat_printf (&str, "note %s %" PRIu64 " %" PRId64 " %" PRId64 " %016" PRIx64 " %016" PRIx64 " %s\n",
+                        note->id, note->size, note->mtime_sec, note->mtime_nsec,
+                        note->content_hash, note->output_hash, note->title);
+        LINKED_LIST_FOR (struct psx_link_t*, link, note->links) {
+            str_cat_printf (&str, "%s %s\n", link->is_summary ? "summary" : "link", link->target);
+        }
+
+        if (note->has_math) {
+            str_cat_c (&str, "has-math\n");
+        }
+        if (note->missing_math) {
+            str_cat_c (&str, "missing-math\n");
+        }
+    }
+
+    // Write to a temporary file and rename it so an interrupted build never
+    // leaves a truncated manifest behind.
+    char *tmp_path = pprintf (&wb->pool, "%s.tmp", path);
+    if (!full_file_write (str_data(&str), str_len(&str), tmp_path)) {
+        if (rename (tmp_path, path) == -1) {
+            printf ("Error writing %s: %s\n", path, strerror(errno));
+        }
+    }
+
+    str_free (&str);
+}
+
+void note_graph_build (struct weaver_build_t *wb)
+{
+    mem_pool_t *pool = &wb->pool;
+
+    // When multiple notes have the same title, links resolve to the first one.
+    wb->title_to_note.pool = pool;
+    uint32_t num_graph_notes = 0;
+    LINKED_LIST_FOR (struct note_t*, note, wb->notes) {
+        if (note->title != NULL) {
+            note->graph_idx = num_graph_notes++;
+            note_map_insert (&wb->title_to_note, note->title, note);
+        }
+    }
+
+    LINKED_LIST_FOR (struct note_t*, src, wb->notes) {
+        LINKED_LIST_FOR (struct psx_link_t*, link, src->links) {
+            struct note_t *target = note_map_get (&wb->title_to_note, link->target);
+
+            // Multiple links to the same note are stored once, link_mark
+            // is the last note that linked to target.
+            if (target != NULL && target->link_mark != src) {
+                target->link_mark = src;
+
+                LINKED_LIST_APPEND_NEW (pool, struct note_ref_t, src->out_links, out_link);
+                out_link->note = target;
+
+                LINKED_LIST_APPEND_NEW (pool, struct note_ref_t, target->backlinks, backlink);
+                backlink->note = src;
+            }
+        }
+    }
+}
+
+void str_cat_json_string (string_t *str, char *s)
+{
+    str_cat_c (str, "\"");
+    for (char *c = s; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            str_cat_printf (str, "\\%c", *c);
+        } else if ((unsigned char)*c < 0x20) {
+            str_cat_printf (str, "\\u%04x", *c);
+        } else {
+            strn_cat_c (str, c, 1);
+        }
+    }
+    str_cat_c (str, "\"");
+}
+
+void str_cat_json_note_refs (string_t *str, char *name, struct note_t *notes, bool backlinks)
+{
+    str_cat_printf (str, "\"%s\": {", name);
+
+    bool is_first = true;
+    LINKED_LIST_FOR (struct note_t*, note, notes) {
+        struct note_ref_t *refs = backlinks ? note->backlinks : note->out_links;
+        if (refs == NULL) continue;
+
+        if (!is_first) str_cat_c (str, ",");
+        is_first = false;
+
+        str_cat_c (str, "\n  ");
+        str_cat_json_string (str, note->id);
+        str_cat_c (str, ": [");
+        LINKED_LIST_FOR (struct note_ref_t*, ref, refs) {
+            str_cat_json_string (str, ref->note->id);
+            if (ref->next != NULL) str_cat_c (str, ", ");
+        }
+        str_cat_c (str, "]");
+    }
+
+    str_cat_c (str, "\n}");
+}
+
+void note_graph_json_write (struct weaver_build_t *wb, char *path)
+{
+    string_t str = {0};
+
+    str_cat_c (&str, "{\n");
+    str_cat_json_note_refs (&str, "note_links", wb->notes, false);
+    str_cat_c (&str, ",\n");
+    str_cat_json_note_refs (&str, "note_backlinks", wb->notes, true);
+
+    str_cat_c (&str, ",\n\"root_notes\": [");
+    bool is_first = true;
+    LINKED_LIST_FOR (struct note_t*, note, wb->notes) {
+        if (note->title != NULL && note->backlinks == NULL) {
+            if (!is_first) str_cat_c (&str, ", ");
+            is_first = false;
+
+            str_cat_json_string (&str, note->id);
+        }
+    }
+    str_cat_c (&str, "]");
+
+    str_cat_c (&str, ",\n\"note_title_to_id\": {");
+    HASH_MAP_FOR (note, &wb->title_to_note, entry) {
+        if (entry != wb->title_to_note.entries) str_cat_c (&str, ",");
+        str_cat_c (&str, "\n  ");
+        str_cat_json_string (&str, entry->key);
+        str_cat_c (&str, ": ");
+        str_cat_json_string (&str, entry->value->id);
+    }
+    str_cat_c (&str, "\n}");
+
+    str_cat_c (&str, ",\n\"id_to_note_title\": {");
+    is_first = true;
+    LINKED_LIST_FOR (struct note_t*, curr_note, wb->notes) {
+        if (curr_note->title == NULL) continue;
+
+        if (!is_first) str_cat_c (&str, ",");
+        is_first = false;
+
+        str_cat_c (&str, "\n  ");
+        str_cat_json_string (&str, curr_note->id);
+        str_cat_c (&str, ": ");
+        str_cat_json_string (&str, curr_note->title);
+    }
+    str_cat_c (&str, "\n}\n}\n");
+
+    full_file_write (str_data(&str), str_len(&str), path);
+    str_free (&str);
+}
+
+void note_graph_index_write (struct weaver_build_t *wb, char *path)
+{
+    mem_pool_t pool = {0};
+
+    uint32_t num_notes = 0;
+    uint32_t num_links = 0;
+    LINKED_LIST_FOR (struct note_t*, note, wb->notes) {
+        if (note->title == NULL) continue;
+
+        num_notes++;
+        LINKED_LIST_FOR (struct note_ref_t*, ref, note->out_links) {
+            num_links++;
+        }
+    }
+
+    char **ids = mem_pool_push_array (&pool, num_notes, char*);
+    char **titles = mem_pool_push_array (&pool, num_notes, char*);
+    uint32_t *link_offsets = mem_pool_push_array (&pool, num_notes + 1, uint32_t);
+    uint32_t *links = mem_pool_push_array (&pool, num_links, uint32_t);
+
+    uint32_t link_idx = 0;
+    LINKED_LIST_FOR (struct note_t*, curr_note, wb->notes) {
+        if (curr_note->title == NULL) continue;
+
+        uint32_t i = curr_note->graph_idx;
+        ids[i] = curr_note->id;
+        titles[i] = curr_note->title;
+        link_offsets[i] = link_idx;
+        LINKED_LIST_FOR (struct note_ref_t*, ref, curr_note->out_links) {
+            links[link_idx++] = ref->note->graph_idx;
+        }
+    }
+    link_offsets[num_notes] = link_idx;
+
+    note_graph_write (path, num_notes, ids, titles, link_offsets, links);
+
+    mem_pool_destroy (&pool);
+}
+
+int main (int argc, char **argv)
+{
+    struct weaver_build_t _wb = {0};
+    struct weaver_build_t *wb = &_wb;
+
+    wb->num_threads = sysconf (_SC_NPROCESSORS_ONLN);
+    char *notes_dir = NULL;
+    for (int i=1; i<argc; i++) {
+        if ((strcmp (argv[i], "-j") == 0 || strcmp (argv[i], "--jobs") == 0) && i+1 < argc) {
+            wb->num_threads = atoi (argv[++i]);
+
+        } else if (strcmp (argv[i], "-f") == 0 || strcmp (argv[i], "--force") == 0) {
+            wb->force = true;
+
+        } else if ((strcmp (argv[i], "-g") == 0 || strcmp (argv[i], "--graph") == 0) && i+1 < argc) {
+            wb->graph_path = argv[++i];
+
+        } else if ((strcmp (argv[i], "-i") == 0 || strcmp (argv[i], "--index") == 0) && i+1 < argc) {
+            wb->index_path = argv[++i];
+
+        } else if (strcmp (argv[i], "--math-cache") == 0 && i+1 < argc) {
+            wb->math_dir = argv[++i];
+
+        } else if (strcmp (argv[i], "--math-renderer") == 0 && i+1 < argc) {
+            wb->math_renderer = argv[++i];
+
+        } else if (notes_dir == NULL) {
+            notes_dir = argv[i];
+
+        } else if (wb->out_dir == NULL) {
+            wb->out_dir = argv[i];
+        }
+    }
+
+    if (notes_dir == NULL) {
+        printf ("Usage: %s [-j NUM_THREADS] [--force] [--graph GRAPH_FILE] [--index INDEX_FILE]\n"
+                "          [--math-cache MATH_DIR [--math-renderer COMMAND]] NOTES_DIR [OUT_DIR]\n", argv[0]);
+        return 1;
+    }
+
+    if (wb->out_dir == NULL) {
+        wb->out_dir = notes_dir;
+    }
+
+    if (wb->num_threads < 1) {
+        wb->num_threads = 1;
+    }
+
+    if (!dir_exists (notes_dir)) {
+        printf ("Notes directory %s does not exist.\n", notes_dir);
+        return 1;
+    }
+
+    if (!ensure_dir_exists (wb->out_dir)) {
+        return 1;
+    }
+
+    if (wb->math_dir != NULL && !ensure_dir_exists (wb->math_dir)) {
+        return 1;
+    }
+
+    wb->manifest.pool = &wb->pool;
+    char *manifest_path = pprintf (&wb->pool, "%s/%s", wb->out_dir, MANIFEST_FNAME);
+    manifest_load (wb, manifest_path);
+    wb->math_cache_changed = wb->old_math_cache != (wb->math_dir != NULL);
+
+    iterate_dir (notes_dir, collect_note, wb);
+
+    wb->note_source.get_note = summary_get_note;
+    wb->note_source.data = wb;
+    psx_tag_register ("summary", psx_tag_summary, &wb->note_source);
+
+    if (wb->math_dir != NULL) {
+        math_cache_init (&wb->math_cache, wb->math_dir);
+        wb->math_source.get_math = math_cache_get_math;
+        wb->math_source.data = &wb->math_cache;
+        psx_tag_register ("math", psx_tag_math, &wb->math_source);
+        psx_tag_register ("Math", psx_tag_math_display, &wb->math_source);
+    }
+
+    // Phase 1: Process notes that were modified since the last build. Notes
+    // where only the modification time changed aren't rendered again.
+    wb->jobs = mem_pool_push_array (&wb->pool, wb->num_notes, struct note_t*);
+    LINKED_LIST_FOR (struct note_t*, note, wb->notes) {
+        note->old = note_map_get (&wb->manifest, note->id);
+
+        if (note->old != NULL) {
+            note->old->seen = true;
+        }
+
+        if (wb->force || note->old == NULL ||
+            note->old->size != note->size ||
+            note->old->mtime_sec != note->mtime_sec ||
+            note->old->mtime_nsec != note->mtime_nsec ||
+            note_math_outdated (wb, note->old)) {
+            wb->jobs[wb->num_jobs++] = note;
+
+        } else {
+            note->title = note->old->title;
+            note->links = note->old->links;
+            note->content_hash = note->old->content_hash;
+            note->output_hash = note->old->output_hash;
+            note->has_math = note->old->has_math;
+            note->missing_math = note->old->missing_math;
+        }
+    }
+
+    int num_rendered = 0;
+    int num_failed = 0;
+    wb->jobs_render = false;
+    run_jobs (wb, &num_rendered, &num_failed);
+
+    // Collect titles that were added, removed or renamed, and titles of notes
+    // whose content changed.
+    struct title_set_map_t changed_titles = {0};
+    changed_titles.pool = &wb->pool;
+    struct title_set_map_t changed_content = {0};
+    changed_content.pool = &wb->pool;
+    LINKED_LIST_FOR (struct note_t*, curr_note, wb->notes) {
+        if (curr_note->title == NULL) continue;
+
+        if (curr_note->rendered &&
+            (curr_note->old == NULL || curr_note->old->content_hash != curr_note->content_hash)) {
+            title_set_map_insert (&changed_content, curr_note->title, true);
+        }
+
+        if (curr_note->old == NULL) {
+            title_set_map_insert (&changed_titles, curr_note->title, true);
+
+        } else if (strcmp (curr_note->title, curr_note->old->title) != 0) {
+            title_set_map_insert (&changed_titles, curr_note->title, true);
+            title_set_map_insert (&changed_titles, curr_note->old->title, true);
+        }
+    }
+
+    LINKED_LIST_FOR (struct note_t*, old_note, wb->old_notes) {
+        if (!old_note->seen) {
+            title_set_map_insert (&changed_titles, old_note->title, true);
+
+            char *out_path = pprintf (&wb->pool, "%s/%s.html", wb->out_dir, old_note->id);
+            if (path_exists (out_path)) {
+                unlink (out_path);
+            }
+        }
+    }
+
+    // Phase 2: Render notes that link to one of the changed titles, or
+    // summarize a note whose content changed. Notes with summaries rendered
+    // in phase 1 are rendered again, now expanding them.
+    wb->num_jobs = 0;
+    if (changed_titles.num_entries > 0 || changed_content.num_entries > 0) {
+        LINKED_LIST_FOR (struct note_t*, linking_note, wb->notes) {
+            if (linking_note->title == NULL) continue;
+
+            LINKED_LIST_FOR (struct psx_link_t*, link, linking_note->links) {
+                bool is_changed = title_set_map_lookup (&changed_titles, link->target, NULL);
+                if (link->is_summary) {
+                    is_changed = is_changed || linking_note->rendered ||
+                        title_set_map_lookup (&changed_content, link->target, NULL);
+                } else {
+                    is_changed = is_changed && !linking_note->rendered;
+                }
+
+                if (is_changed) {
+                    wb->jobs[wb->num_jobs++] = linking_note;
+                    break;
+                }
+            }
+        }
+    }
+
+    wb->jobs_render = true;
+    summary_notes_build (wb);
+    run_jobs (wb, &num_rendered, &num_failed);
+
+    // Phase 3: Render missing math, then render again the notes that used it.
+    if (wb->math_dir != NULL) {
+        wb->num_jobs = 0;
+        if (math_cache_flush (&wb->math_cache, wb->math_renderer) && wb->math_renderer != NULL) {
+            LINKED_LIST_FOR (struct note_t*, note, wb->notes) {
+                if (note->missing_math && note->rendered) {
+                    wb->jobs[wb->num_jobs++] = note;
+                }
+            }
+        }
+
+        run_jobs (wb, &num_rendered, &num_failed);
+        math_cache_destroy (&wb->math_cache);
+    }
+    note_map_destroy (&wb->summary_notes);
+
+    manifest_write (wb, manifest_path);
+
+    if (wb->graph_path != NULL || wb->index_path != NULL) {
+        note_graph_build (wb);
+    }
+
+    if (wb->graph_path != NULL) {
+        note_graph_json_write (wb, wb->graph_path);
+    }
+
+    if (wb->index_path != NULL) {
+        note_graph_index_write (wb, wb->index_path);
+    }
+
+    printf ("Rendered %d of %d notes", num_rendered, wb->num_notes);
+    if (num_failed > 0) {
+        printf (", %d failed", num_failed);
+    }
+    printf ("\n");
+
+    mem_pool_destroy (&wb->pool);
+    regcomp_cache_destroy ();
+
+    return num_failed == 0 ? 0 : 1;
+}
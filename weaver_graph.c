@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2021 Santiago León O.
+ */
+
+#include "common.h"
+#include "binary_tree.c"
+
+#define NOTE_GRAPH_IMPL
+#include "note_graph.h"
+
+// Queries a note graph index written by weaver_build --index. The index is
+// memory mapped, so the cost of a query doesn't depend on the size of the
+// graph.
+//
+// Usage:
+//  weaver_graph INDEX_FILE links NOTE
+//  weaver_graph INDEX_FILE backlinks NOTE
+//  weaver_graph INDEX_FILE orphans
+//
+// NOTE can be the id or the title of a note. Results are printed as
+// "<id> - <title>", one per line.
+
+void print_notes (struct note_graph_t *graph, uint32_t *notes, uint32_t count)
+{
+    for (uint32_t i=0; i<count; i++) {
+        printf ("%s - %s\n", note_graph_id (graph, notes[i]), note_graph_title (graph, notes[i]));
+    }
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 3) {
+        printf ("Usage: %s INDEX_FILE links|backlinks|orphans [NOTE]\n", argv[0]);
+        return 1;
+    }
+
+    struct note_graph_t graph;
+    if (!note_graph_open (&graph, argv[1])) {
+        return 1;
+    }
+
+    int retval = 0;
+    char *query = argv[2];
+    if (strcmp (query, "orphans") == 0) {
+        uint32_t count;
+        uint32_t *orphans = note_graph_orphans (&graph, &count);
+        print_notes (&graph, orphans, count);
+
+    } else if ((strcmp (query, "links") == 0 || strcmp (query, "backlinks") == 0) && argc > 3) {
+        int note = note_graph_find_id (&graph, argv[3]);
+        if (note == -1) {
+            note = note_graph_find_title (&graph, argv[3]);
+        }
+
+        if (note != -1) {
+            uint32_t count;
+            uint32_t *notes;
+            if (strcmp (query, "links") == 0) {
+                notes = note_graph_links (&graph, note, &count);
+            } else {
+                notes = note_graph_backlinks (&graph, note, &count);
+            }
+            print_notes (&graph, notes, count);
+
+        } else {
+            printf ("No note with id or title '%s'\n", argv[3]);
+            retval = 1;
+        }
+
+    } else {
+        printf ("Unknown query '%s'\n", query);
+        retval = 1;
+    }
+
+    note_graph_close (&graph);
+
+    return retval;
+}